@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Admission check right after accept. A token bucket bounds how fast new
+// sessions are set up (each one costs a broadcast, and a fork on
+// np_multi_proc), connections over the rate or over capacity get a one line
+// answer and are closed at once instead of waiting in the backlog.
+class AdmissionControl {
+  public:
+    double rate = 0;  // sessions per second, 0 admits everything
+    double burst = 0; // bucket size, 0 means one second's worth
+
+    bool admit(uint64_t nowNs) {
+        if (rate <= 0) {
+            return true;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        double size = burst > 0 ? burst : std::max(rate, 1.0);
+        if (lastNs == 0) {
+            tokens = size;
+        } else {
+            tokens = std::min(size, tokens + (nowNs - lastNs) / 1e9 * rate);
+        }
+        lastNs = nowNs;
+        if (tokens < 1) {
+            return false;
+        }
+        tokens -= 1;
+        return true;
+    }
+
+    static void reject(int fd, const std::string &msg) {
+        send(fd, msg.c_str(), msg.size(), MSG_NOSIGNAL);
+        close(fd);
+    }
+
+  private:
+    std::mutex lock; // accept threads of np_single_proc share the bucket
+    double tokens = 0;
+    uint64_t lastNs = 0;
+};
+
+#define SERVER_FULL_MESSAGE "*** Server is full. ***\n"
+#define SERVER_BUSY_MESSAGE "*** Server is busy, try again later. ***\n"
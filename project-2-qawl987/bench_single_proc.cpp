@@ -0,0 +1,231 @@
+#include "npshell_single_proc.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#define PROMPT "% "
+
+// Micro benchmarks for the single process server building blocks.
+// Usage: bench_single_proc yell [users] [yells per iteration] [iterations]
+//        bench_single_proc userpipe [users] [operations]
+
+using Clock = chrono::steady_clock;
+
+struct BenchResult {
+    long syscalls = 0;
+    vector<double> latencies; // usec per event loop iteration
+};
+
+// Reads and discards everything the "server" writes, like telnet would
+class Drainer {
+    int epfd;
+    atomic<bool> running{true};
+    thread worker;
+
+  public:
+    explicit Drainer(const vector<int> &fds) {
+        epfd = epoll_create1(0);
+        for (int fd : fds) {
+            epoll_event ev = {.events = EPOLLIN, .data = {.fd = fd}};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        worker = thread([this] {
+            epoll_event events[256];
+            char buf[65536];
+            while (running) {
+                int n = epoll_wait(epfd, events, 256, 50);
+                for (int i = 0; i < n; i++) {
+                    read(events[i].data.fd, buf, sizeof(buf));
+                }
+            }
+        });
+    }
+
+    ~Drainer() {
+        running = false;
+        worker.join();
+        close(epfd);
+    }
+};
+
+void printResult(const string &name, BenchResult &r, int iterations) {
+    sort(r.latencies.begin(), r.latencies.end());
+    auto pct = [&](double p) {
+        return r.latencies[min(r.latencies.size() - 1,
+                               (size_t)(p * r.latencies.size()))];
+    };
+    double total = 0;
+    for (double v : r.latencies) {
+        total += v;
+    }
+    printf("%-10s syscalls/iter %8.1f  mean %9.1fus  p50 %9.1fus  p99 "
+           "%9.1fus\n",
+           name.c_str(), (double)r.syscalls / iterations,
+           total / r.latencies.size(), pct(0.5), pct(0.99));
+}
+
+// Old behaviour: build the message and write() it to every user, then write
+// the prompt to the yelling user.
+BenchResult yellStormWrite(UserDirectory &userList, int users, int yells,
+                           int iterations) {
+    BenchResult r;
+    for (int it = 0; it < iterations; it++) {
+        auto start = Clock::now();
+        for (int y = 0; y < yells; y++) {
+            UserInfo *sender = userList.byId(1 + (it * yells + y) % users);
+            string msg = "*** " + sender->name + " yelled ***: storm " +
+                         to_string(y) + "\n";
+            for (int id : userList.online()) {
+                write(userList.byId(id)->fd, msg.c_str(), msg.size());
+                r.syscalls++;
+            }
+            write(sender->fd, PROMPT, strlen(PROMPT));
+            r.syscalls++;
+        }
+        r.latencies.push_back(
+            chrono::duration<double, micro>(Clock::now() - start).count());
+    }
+    return r;
+}
+
+// New behaviour: one shared buffer per yell, queued by reference, and one
+// writev per user at the end of the event loop iteration.
+BenchResult yellStormWritev(UserDirectory &userList, int users, int yells,
+                            int iterations) {
+    BenchResult r;
+    SharedBuffer prompt = makeBuffer(PROMPT);
+    for (int it = 0; it < iterations; it++) {
+        auto start = Clock::now();
+        for (int y = 0; y < yells; y++) {
+            UserInfo *sender = userList.byId(1 + (it * yells + y) % users);
+            string msg = "*** " + sender->name + " yelled ***: storm " +
+                         to_string(y) + "\n";
+            ProcessExecutor::broadcastMessage(msg);
+            ProcessExecutor::sendMessage(sender, prompt);
+        }
+        r.syscalls += ProcessExecutor::flushOutput();
+        r.latencies.push_back(
+            chrono::duration<double, micro>(Clock::now() - start).count());
+    }
+    return r;
+}
+
+// The map used before UserPipeRegistry, with its XOR-shift hash
+struct pair_hash {
+    size_t operator()(const pair<int, int> &p) const {
+        return hash<int>()(p.first) ^ (hash<int>()(p.second) << 1);
+    }
+};
+
+// Random mix of pipe creation, reads and logouts against both structures.
+// Fds are fake (-1) so only the bookkeeping is measured.
+void userPipeChurn(int users, int operations) {
+    struct Op {
+        int kind; // 0: create, 1: read, 2: logout
+        int recvId;
+        int sendId;
+    };
+    mt19937 rng(42);
+    uniform_int_distribution<int> pickUser(1, users);
+    uniform_int_distribution<int> pickKind(0, 99);
+    vector<Op> ops(operations);
+    for (Op &op : ops) {
+        int k = pickKind(rng);
+        op.kind = k < 55 ? 0 : (k < 97 ? 1 : 2);
+        op.recvId = pickUser(rng);
+        op.sendId = pickUser(rng);
+    }
+
+    unordered_map<pair<int, int>, pair<int, int>, pair_hash> legacy;
+    auto start = Clock::now();
+    for (const Op &op : ops) {
+        auto id = make_pair(op.recvId, op.sendId);
+        if (op.kind == 0) {
+            if (legacy.find(id) == legacy.end()) {
+                legacy[id] = make_pair(-1, -1);
+            }
+        } else if (op.kind == 1) {
+            auto it = legacy.find(id);
+            if (it != legacy.end()) {
+                legacy.erase(it);
+            }
+        } else {
+            for (auto it = legacy.begin(); it != legacy.end();) {
+                if (it->first.first == op.recvId ||
+                    it->first.second == op.recvId) {
+                    it = legacy.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+    double legacyMs =
+        chrono::duration<double, milli>(Clock::now() - start).count();
+
+    UserPipeRegistry registry(users);
+    start = Clock::now();
+    for (const Op &op : ops) {
+        if (op.kind == 0) {
+            if (!registry.contains(op.recvId, op.sendId)) {
+                registry.add(op.recvId, op.sendId, {-1, -1});
+            }
+        } else if (op.kind == 1) {
+            UserPipeRegistry::Fds fds;
+            registry.take(op.recvId, op.sendId, fds);
+        } else {
+            registry.removeUser(op.recvId);
+        }
+    }
+    double registryMs =
+        chrono::duration<double, milli>(Clock::now() - start).count();
+
+    printf("user pipe churn: %d users, %d operations\n", users, operations);
+    printf("%-10s %9.1fms  %7.1fns/op  %zu pipes left\n", "map",
+           legacyMs, legacyMs * 1e6 / operations, legacy.size());
+    printf("%-10s %9.1fms  %7.1fns/op  %zu pipes left\n", "registry",
+           registryMs, registryMs * 1e6 / operations, registry.size());
+}
+
+void yellStorm(int users, int yells, int iterations) {
+    UserDirectory userList(users);
+    vector<int> peers;
+    for (int idx = 1; idx <= users; idx++) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        UserInfo *user = userList.login(sv[0], "bench:" + to_string(idx));
+        userList.rename(user, "user" + to_string(idx));
+        Shard::current->attach(user, makeBuffer(""));
+        peers.push_back(sv[1]);
+    }
+
+    printf("yell storm: %d users, %d yells per iteration, %d iterations\n",
+           users, yells, iterations);
+    {
+        Drainer drainer(peers);
+        BenchResult before = yellStormWrite(userList, users, yells, iterations);
+        BenchResult after =
+            yellStormWritev(userList, users, yells, iterations);
+        printResult("write", before, iterations);
+        printResult("writev", after, iterations);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Shard::all.push_back(new Shard(0));
+    Shard::current = Shard::all[0];
+    string mode = argc > 1 ? argv[1] : "all";
+    if (mode == "yell" || mode == "all") {
+        yellStorm(argc > 2 ? atoi(argv[2]) : MAXUSER,
+                  argc > 3 ? atoi(argv[3]) : 8,
+                  argc > 4 ? atoi(argv[4]) : 2000);
+    }
+    if (mode == "userpipe" || mode == "all") {
+        userPipeChurn(argc > 2 ? atoi(argv[2]) : 2000,
+                      argc > 3 ? atoi(argv[3]) : 200000);
+    }
+    return 0;
+}
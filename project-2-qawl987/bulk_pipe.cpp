@@ -0,0 +1,69 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bulk user pipes (--bulk-pipes BYTES). The command on the sending side of
+// `>N` writes into a memfd instead of a pipe(2): it never waits for the
+// receiver and the server waits for it like for `> file`. Once it exited
+// the memfd is sealed and rewound, and the receiver's `<N` gets it as
+// stdin, a regular file its command may read or mmap without another copy.
+// The data waits in memory instead of in a blocked writer, so each sender
+// may have at most BYTES waiting in bulk pipes nobody read yet. The writer
+// runs with RLIMIT_FSIZE one byte past what is left and is stopped by
+// SIGXFSZ there: a memfd longer than the room is output that didn't fit,
+// the pipe is dropped and both users are told instead of delivering it cut.
+class BulkPipe {
+  public:
+    static inline off_t limit = 0; // bytes per sender, 0 keeps pipe(2)
+
+    static bool enabled() { return limit > 0; }
+
+    // A fresh bulk pipe, -1 on failure
+    static int create() {
+        return memfd_create("user_pipe", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    }
+
+    // What a sender may still write, held is what it has waiting in other
+    // bulk pipes
+    static off_t room(off_t held) { return held < limit ? limit - held : 0; }
+
+    // In the writer's child before exec
+    static void limitWriter(off_t held) {
+        rlim_t size = room(held) + 1;
+        rlimit fsize = {size, size};
+        setrlimit(RLIMIT_FSIZE, &fsize);
+        signal(SIGXFSZ, SIG_DFL);
+    }
+
+    // The writer started with held went over its room: it was stopped at
+    // the extra byte, or wrote it and no more
+    static bool overrun(off_t bytes, off_t held) { return bytes > room(held); }
+
+    static std::string overrunMessage(int sendId, int recvId) {
+        return "*** Error: the pipe #" + std::to_string(sendId) + "->#" +
+               std::to_string(recvId) + " went over " +
+               std::to_string(limit) + " bytes and was dropped. ***\n";
+    }
+
+    // The writer is done: freeze the contents and rewind for the reader.
+    // Returns the size.
+    static off_t seal(int fd) {
+        fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        lseek(fd, 0, SEEK_SET);
+        return size(fd);
+    }
+
+    // Bytes in fd if it is a bulk pipe, 0 for a pipe(2)
+    static off_t size(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            return 0;
+        }
+        return st.st_size;
+    }
+};
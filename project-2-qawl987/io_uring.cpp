@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Just enough of io_uring for an event loop, on the raw syscalls since
+// liburing is not part of the build. One ring per reactor thread: the
+// submission queue is filled with prep*() and handed to the kernel by
+// submitAndWait(), which is then the only syscall of a loop iteration.
+// Socket input lands in provided buffers, so a multishot recv keeps
+// delivering without being re-armed. Completions with user_data 0 belong
+// to the ring itself and can be ignored.
+class IoUring {
+  public:
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    ~IoUring() {
+        delete[] bufBase;
+        if (sqes != nullptr) {
+            munmap(sqes, sqesSize);
+        }
+        if (sqRing != nullptr) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (cqRing != nullptr) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // False when the kernel has no io_uring (or it is filtered out), or
+    // lacks one of the operations or multishot modes used here
+    bool init(unsigned entries) {
+        io_uring_params params = {};
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0 || !(params.features & IORING_FEAT_EXT_ARG) ||
+            !(params.features & IORING_FEAT_FAST_POLL) || !probe()) {
+            return false;
+        }
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED ||
+            sqes == MAP_FAILED) {
+            sqRing = sqRing == MAP_FAILED ? nullptr : sqRing;
+            cqRing = cqRing == MAP_FAILED ? nullptr : cqRing;
+            sqes = sqes == MAP_FAILED ? nullptr : sqes;
+            return false;
+        }
+        char *sq = (char *)sqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        unsigned *array = (unsigned *)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++) {
+            array[i] = i; // sqes are always used in ring order
+        }
+        char *cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        localTail = submittedTail = *sqTail;
+        skipSuccess = params.features & IORING_FEAT_CQE_SKIP;
+        return probeMultishot();
+    }
+
+    // count buffers of size bytes for IOSQE_BUFFER_SELECT reads. These are
+    // handed over with IORING_OP_PROVIDE_BUFFERS rather than a registered
+    // buffer ring, which some kernels accept but never draw from.
+    void setupBuffers(uint16_t group, unsigned count, unsigned size) {
+        bufGroup = group;
+        bufSize = size;
+        bufBase = new char[(size_t)count * size];
+        provide(0, count);
+    }
+
+    char *buffer(uint16_t id) const { return bufBase + (size_t)id * bufSize; }
+
+    // Give a consumed buffer back to the kernel, with the next submission
+    void recycle(uint16_t id) { provide(id, 1); }
+
+    void prepAcceptMultishot(int sock, uint64_t data) {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_ACCEPT, sock, data);
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+
+    void prepRecvMultishot(int sock, uint64_t data) {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_RECV, sock, data);
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = bufGroup;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+
+    void prepPollMultishot(int pollFd, uint64_t data) {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_POLL_ADD, pollFd, data);
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+    // link: the next prepared sqe only starts once this one succeeded
+    void prepSendmsg(int sock, const msghdr *msg, int flags, uint64_t data,
+                     bool link) {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_SENDMSG, sock, data);
+        sqe->addr = (uint64_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        if (link) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+    }
+
+    // Cancel the request submitted with user_data target
+    void prepCancel(uint64_t target, uint64_t data) {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_ASYNC_CANCEL, -1, data);
+        sqe->addr = target;
+    }
+
+    // Submit everything prepared, then wait until waitNr completions are
+    // ready or timeoutMs passed (-1 waits forever). Returns -errno on error.
+    int submitAndWait(unsigned waitNr, int timeoutMs) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = localTail - submittedTail;
+        unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        io_uring_getevents_arg arg = {};
+        __kernel_timespec ts;
+        if (timeoutMs >= 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            arg.ts = (uint64_t)&ts;
+        }
+        flags |= IORING_ENTER_EXT_ARG;
+        enters++;
+        int n = syscall(__NR_io_uring_enter, fd, toSubmit, waitNr, flags, &arg,
+                        sizeof(arg));
+        if (n < 0) {
+            return errno == ETIME ? 0 : -errno;
+        }
+        submittedTail += n;
+        return n;
+    }
+
+    bool popCompletion(io_uring_cqe &out) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        out = cqes[head & cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    uint64_t enters = 0; // io_uring_enter calls, for the stats
+
+  private:
+    int fd = -1;
+    void *sqRing = nullptr;
+    void *cqRing = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    unsigned *sqHead, *sqTail, sqMask, sqEntries;
+    unsigned *cqHead, *cqTail, cqMask;
+    io_uring_cqe *cqes;
+    unsigned localTail = 0;     // prepared, not yet visible to the kernel
+    unsigned submittedTail = 0; // consumed by io_uring_enter
+
+    bool skipSuccess = false; // IOSQE_CQE_SKIP_SUCCESS is available
+    char *bufBase = nullptr;
+    unsigned bufSize = 0;
+    uint16_t bufGroup = 0;
+
+    void provide(uint16_t first, unsigned count) {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_PROVIDE_BUFFERS, count, 0);
+        sqe->addr = (uint64_t)buffer(first);
+        sqe->len = bufSize;
+        sqe->buf_group = bufGroup;
+        sqe->off = first;
+        if (skipSuccess) {
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        }
+    }
+
+    bool probe() {
+        size_t len = sizeof(io_uring_probe) +
+                     IORING_OP_LAST * sizeof(io_uring_probe_op);
+        std::vector<char> mem(len, 0);
+        io_uring_probe *p = (io_uring_probe *)mem.data();
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p,
+                    IORING_OP_LAST) < 0) {
+            return false;
+        }
+        for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+                       IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+                       IORING_OP_PROVIDE_BUFFERS}) {
+            if (op > p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Kernels before multishot accept (5.19) and recv (6.0) know the
+    // opcodes but fail the flag with -EINVAL, and a multishot accept that
+    // fails is armed again forever. So try both on throwaway sockets: an
+    // accept on a listening socket, cancelled, and a recv of pending data
+    // with no buffers provided yet, which ends in -ENOBUFS.
+    bool probeMultishot() {
+        enum { ACCEPT = 1, CANCEL, RECV };
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int pair[2] = {-1, -1};
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool supported =
+            listener >= 0 &&
+            bind(listener, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+            listen(listener, 1) == 0 &&
+            socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0 &&
+            write(pair[1], "", 1) == 1;
+        int pending = 0;
+        if (supported) {
+            prepAcceptMultishot(listener, ACCEPT);
+            prepCancel(ACCEPT, CANCEL);
+            prepRecvMultishot(pair[0], RECV);
+            pending = 3;
+        }
+        for (int round = 0; pending > 0 && round < 10; round++) {
+            if (submitAndWait(1, 100) < 0) {
+                break;
+            }
+            io_uring_cqe cqe;
+            while (popCompletion(cqe)) {
+                pending--;
+                if (cqe.user_data != CANCEL && cqe.res == -EINVAL) {
+                    supported = false;
+                }
+            }
+        }
+        for (int sock : {listener, pair[0], pair[1]}) {
+            if (sock >= 0) {
+                close(sock);
+            }
+        }
+        return supported && pending == 0;
+    }
+
+    io_uring_sqe *nextSqe(int opcode, int target, uint64_t data) {
+        if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >=
+            sqEntries) {
+            submitAndWait(0, -1); // full, hand over what we have
+        }
+        io_uring_sqe *sqe = &sqes[localTail & sqMask];
+        localTail++;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = target;
+        sqe->user_data = data;
+        return sqe;
+    }
+};
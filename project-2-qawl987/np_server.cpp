@@ -0,0 +1,216 @@
+#define NP_SINGLE_PROC_NO_MAIN
+#include "np_single_proc.cpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+
+// One np server binary for comparing concurrency models on the same shell
+// core (npshell_single_proc) and the same options:
+//   reactor   one event loop thread (np_single_proc)
+//   threaded  --threads reactor shards, all cores by default
+//   session   a thread per connection, started at login and ended at
+//             logout, on a shard of its own; the main thread only accepts
+//   fork      a process per connection, like np_simple
+//   prefork   --workers processes, each serving one connection at a time
+//   multi     np_multi_proc, process per user with the user list in shm
+// fork and prefork are single user models: a process has a directory of
+// its own, so every session is user #1 alone there and who/tell/yell and
+// user pipes have nobody to reach. They take --max-users 1 only, compare
+// the multi-user protocol under the other models. multi has a shell core
+// of its own and is executed from the np_multi_proc binary next to this
+// one, with the remaining arguments.
+//
+// Usage: np_server --model NAME [--workers N] [np_single_proc options] port
+
+// Remove "--name value" or "--name=value" from argv, "" when absent
+string takeOption(int &argc, char *argv[], const string &name) {
+    string value;
+    int out = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == name && i + 1 < argc) {
+            value = argv[++i];
+        } else if (arg.compare(0, name.size() + 1, name + "=") == 0) {
+            value = arg.substr(name.size() + 1);
+        } else {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    argv[argc] = nullptr;
+    return value;
+}
+
+int createListeners() {
+    int msock = createSocket(options.port, options.backlog, options.reusePort);
+    if (!options.unixPath.empty()) {
+        unixSock = createUnixSocket(options.unixPath, options.backlog);
+        if (unixSock < 0) {
+            exit(1);
+        }
+    }
+    return msock;
+}
+
+void runMulti(char *argv[]) {
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    string dir = ".";
+    if (len > 0) {
+        self[len] = '\0';
+        dir = string(self);
+        dir = dir.substr(0, dir.rfind('/'));
+    }
+    string path = dir + "/np_multi_proc";
+    argv[0] = (char *)"np_multi_proc";
+    execv(path.c_str(), argv);
+    perror(path.c_str());
+    exit(1);
+}
+
+// Next connection on msock or unixSock, -1 when accept failed: with
+// non-blocking listeners another process may have taken it
+int acceptNext(int msock, sockaddr_storage &addr) {
+    pollfd listeners[2] = {{.fd = msock, .events = POLLIN, .revents = 0},
+                           {.fd = unixSock, .events = POLLIN, .revents = 0}};
+    while (poll(listeners, 2, -1) < 0) {
+    }
+    int readyfd = listeners[1].revents & POLLIN ? unixSock : msock;
+    socklen_t alen = sizeof(addr);
+    return accept4(readyfd, (sockaddr *)&addr, &alen, SOCK_CLOEXEC);
+}
+
+// A one user directory and one shard, for the session processes of fork
+// and prefork. The shard loop returns when its session is over. The ring
+// is set up here, once: the session's socket is watched before the loop
+// starts, and it must be watched by the ring the loop will poll.
+void createSessionShard() {
+    options.threads = 1;
+    options.exitWhenEmpty = true;
+    createShards();
+    Shard::current = Shard::all[0];
+    if (options.ioUring) {
+        setupRing(Shard::current, -1);
+        options.ioUring = false; // for runShard(), done already
+    }
+}
+
+// Serve one connection to its end, unless login turned it away
+void serveSession(int ssock, const sockaddr_storage &addr) {
+    userLogin(ssock, addr);
+    if (Shard::current->idle()) {
+        return;
+    }
+    ProcessExecutor::flushOutput(); // greeting, before the first wait
+    runShards(-1);
+}
+
+// The parent only accepts. Each session gets a process of its own, which
+// exits once the user has left.
+void runForkPerConnection() {
+    int msock = createListeners();
+    while (1) {
+        sockaddr_storage addr;
+        int ssock = acceptNext(msock, addr);
+        if (ssock < 0) {
+            continue;
+        }
+        if (!admission.admit(monotonicNs())) {
+            serverStats->rejected++;
+            AdmissionControl::reject(ssock, SERVER_BUSY_MESSAGE);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("server: fork error");
+        } else if (pid == 0) {
+            close(msock);
+            if (unixSock >= 0) {
+                close(unixSock);
+                unixSock = -1;
+            }
+            admission.rate = 0; // admitted by the parent already
+            createSessionShard();
+            serveSession(ssock, addr);
+            exit(0);
+        }
+        close(ssock);
+    }
+}
+
+// Sessions without the fork: workers take turns accepting on the shared
+// listeners, which are non-blocking so the ones that lose a wakeup go
+// back to waiting. A worker serves its session, then accepts the next.
+void runPrefork(int workers) {
+    int msock = createListeners();
+    for (int sock : {msock, unixSock}) {
+        if (sock >= 0) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("server: fork error");
+        } else if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM); // the pool goes with the parent
+            createSessionShard();
+            while (1) {
+                sockaddr_storage addr;
+                int ssock = acceptNext(msock, addr);
+                if (ssock >= 0) {
+                    serveSession(ssock, addr);
+                }
+            }
+        }
+    }
+    close(msock);
+    if (unixSock >= 0) {
+        close(unixSock);
+    }
+    // SIGCHLD is ignored, so this returns once every worker is gone
+    while (wait(nullptr) > 0 || errno == EINTR) {
+    }
+}
+
+int main(int argc, char *argv[]) {
+    string model = takeOption(argc, argv, "--model");
+    string workers = takeOption(argc, argv, "--workers");
+    int cores = max(1u, thread::hardware_concurrency());
+    if (model == "multi") {
+        runMulti(argv);
+    }
+    if (model != "reactor" && model != "threaded" && model != "session" &&
+        model != "fork" && model != "prefork") {
+        cerr << "Usage: " << argv[0]
+             << " --model reactor|threaded|session|fork|prefork|multi"
+                " [--workers N] [np_single_proc options] port"
+             << endl;
+        exit(1);
+    }
+    parseOptions(argc, argv);
+    if ((model == "fork" || model == "prefork") && options.maxUser != 1) {
+        cerr << "--model " << model << " serves one user per process, run it"
+             << " with --max-users 1" << endl;
+        exit(1);
+    }
+    signal(SIGCHLD, SIG_IGN);
+    if (model == "fork") {
+        runForkPerConnection();
+    } else if (model == "prefork") {
+        runPrefork(workers.empty() ? cores : max(1, atoi(workers.c_str())));
+    } else {
+        if (model == "reactor") {
+            options.threads = 1;
+        } else if (model == "session") {
+            // shard 0 accepts, userLogin() starts each session's thread
+            options.threads = 1;
+            Shard::perSession = true;
+        } else if (options.threads == 1) {
+            options.threads = cores;
+        }
+        int msock = createListeners();
+        createShards();
+        runShards(msock);
+    }
+}
@@ -1,14 +1,51 @@
 #include "npshell_simple.cpp"
+#include "session_capture.cpp"
+#include "tcp_output.cpp"
+#include "unix_listener.cpp"
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <poll.h>
 #define MAX_LINE 15000
 #define MAXUSER 30
 
 int main(int argc, char *argv[]) {
-    int SERV_TCP_PORT = std::atoi(argv[1]);
+    static const option longOptions[] = {
+        {"capture", required_argument, nullptr, 'C'},
+        {"tcp-output", required_argument, nullptr, 'o'},
+        {"unix", required_argument, nullptr, 'U'},
+        {nullptr, 0, nullptr, 0},
+    };
+    string usage = "Usage: " + string(argv[0]) +
+                   " [--capture FILE] [--tcp-output nagle|nodelay|cork]"
+                   " [--unix PATH|@NAME] port";
+    string unixPath;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "C:o:U:", longOptions, nullptr)) !=
+           -1) {
+        bool ok = false;
+        if (opt == 'C') {
+            ok = SessionCapture::open(optarg);
+        } else if (opt == 'o') {
+            ok = TcpOutput::parse(optarg);
+        } else if (opt == 'U') {
+            unixPath = optarg;
+            ok = true;
+        }
+        if (!ok) {
+            cerr << usage << endl;
+            exit(1);
+        }
+    }
+    if (optind >= argc) {
+        cerr << usage << endl;
+        exit(1);
+    }
+    int SERV_TCP_PORT = std::atoi(argv[optind]);
     int listenfd, connfd;
     pid_t childpid;
     socklen_t clilen;
-    struct sockaddr_in cli_addr, serv_addr;
+    struct sockaddr_in serv_addr;
+    struct sockaddr_storage cli_addr;
 
     // Create listening socket
     if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -45,12 +82,27 @@ int main(int argc, char *argv[]) {
 
     cerr << "Server listening on port " << SERV_TCP_PORT << "..." << endl;
 
+    // -1 when there is no unix listener, poll skips it
+    int unixfd = -1;
+    if (!unixPath.empty()) {
+        unixfd = createUnixSocket(unixPath, MAXUSER);
+        if (unixfd < 0) {
+            exit(1);
+        }
+    }
+    pollfd listeners[2] = {{.fd = listenfd, .events = POLLIN, .revents = 0},
+                           {.fd = unixfd, .events = POLLIN, .revents = 0}};
+
     // Prevent zombie processes by ignoring SIGCHLD
     signal(SIGCHLD, SIG_IGN);
 
     while (1) { // Main accept loop
+        if (poll(listeners, 2, -1) < 0) {
+            continue;
+        }
+        int readyfd = listeners[1].revents & POLLIN ? unixfd : listenfd;
         clilen = sizeof(cli_addr);
-        connfd = accept(listenfd, (struct sockaddr *)&cli_addr, &clilen);
+        connfd = accept(readyfd, (struct sockaddr *)&cli_addr, &clilen);
 
         if (connfd < 0) {
             if (errno == EINTR)
@@ -62,14 +114,19 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        cerr << "Connection accepted from " << inet_ntoa(cli_addr.sin_addr)
-             << ":" << ntohs(cli_addr.sin_port) << endl;
+        string peer = peerName(connfd, cli_addr);
+        cerr << "Connection accepted from " << peer << endl;
 
+        uint32_t session = SessionCapture::newSession();
         if ((childpid = fork()) < 0) {
             perror("server: fork error");
             close(connfd);          // Close connection if fork fails
         } else if (childpid == 0) { /* --- Child process --- */
             close(listenfd); /* Child doesn't need the listening socket */
+            if (unixfd >= 0) {
+                close(unixfd);
+            }
+            TcpOutput::setup(connfd);
 
             // ****** KEY CHANGE: Redirect STDOUT and STDERR to the client
             if (dup2(connfd, STDOUT_FILENO) < 0) {
@@ -87,6 +144,7 @@ int main(int argc, char *argv[]) {
             // connfd HERE - needed for recv!
 
             setenv("PATH", "bin:.", 1);
+            SessionCapture::record(SessionCapture::OPEN, session, 0, peer);
 
             PipeManager pipe_manager;
             char inputBuffer[MAX_LINE + 1]; // +1 for null terminator
@@ -109,6 +167,7 @@ int main(int argc, char *argv[]) {
                 }
 
                 string input(inputBuffer);
+                SessionCapture::recordLine(session, 0, input);
                 input.erase(input.find_last_not_of("\r\n") +
                             1); // Trim trailing whitespace/newlines
 
@@ -122,6 +181,9 @@ int main(int argc, char *argv[]) {
                     break; // Exit the loop cleanly
                 }
 
+                // command output and the prompt below leave together
+                TcpOutput::cork(connfd);
+
                 // --- Process the command using npshell ---
                 try {
                     CommandParser parser(input, pipe_manager);
@@ -136,8 +198,10 @@ int main(int argc, char *argv[]) {
 
                 // --- Send next prompt ---
                 cout << "% " << flush; // Use cout, it goes to the socket
+                TcpOutput::uncork(connfd);
             }
 
+            SessionCapture::record(SessionCapture::CLOSE, session, 0);
             cerr << "Child process terminating for client."
                  << endl;  // Log on server console
             close(connfd); // Close the connection socket before exiting child
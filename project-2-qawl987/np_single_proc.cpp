@@ -1,5 +1,11 @@
 #include "npshell_single_proc.cpp"
+#include "admission.cpp"
+#include "session_capture.cpp"
+#include "tcp_output.cpp"
+#include "unix_listener.cpp"
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <thread>
 #define MAX_LINE 15000
 #define MAXUSER 30
 #define PROMPT "% "
@@ -8,78 +14,86 @@ const string WELCOME_MESSAGE = "****************************************\n"
                                "** Welcome to the information server. **\n"
                                "****************************************\n";
 
-vector<UserInfo> userList(MAXUSER + 1);
+// Shared by every queue, encoded once for the whole server lifetime
+const SharedBuffer WELCOME_BUFFER = makeBuffer(WELCOME_MESSAGE);
+const SharedBuffer PROMPT_BUFFER = makeBuffer(PROMPT);
 
-unordered_map<pair<int, int>, pair<int, int>, pair_hash> userPipe;
+struct ServerOptions {
+    int port = 0;
+    int maxUser = MAXUSER;
+    int threads = 1; // reactor shards, users are spread by ID
+    int quantum = 4;   // DRR credit per round, in pipeline stages
+    int maxStages = 0; // concurrent children per user, 0 is unlimited
+    int backlog = SOMAXCONN;
+    bool reusePort = false; // a listening socket per shard
+    string unixPath;        // AF_UNIX listener, polled by shard 0
+    bool ioUring = false;   // io_uring instead of epoll, where available
+    bool exitWhenEmpty = false; // np_server --model fork or prefork
+};
 
-int getUserIndex(int fd) {
-    for (int idx = 1; idx <= MAXUSER; idx++) {
-        if (userList[idx].fd == fd) {
-            return idx;
-        }
-    }
-    return -1;
-}
+ServerOptions options;
+AdmissionControl admission;
+int unixSock = -1;
 
-void initUserInfos(int idx) {
-    userList[idx].isLogin = false;
-    userList[idx].id = 0;
-    userList[idx].name = "(no name)";
-    userList[idx].ipPort = "";
-    userList[idx].fd = -1;
-    userList[idx].env.clear();
-    userList[idx].env["PATH"] = "bin:."; // initial PATH is bin/ and ./
-    userList[idx].cmdCount = 0;
+// Created in main once the capacity is known
+UserDirectory *userList;
+UserPipeRegistry *userPipe;
+
+// Append n bytes the client sent and collect every complete line
+void splitInput(UserInfo *user, const char *buf, int n,
+                vector<string> &lines) {
+    user->inputBuffer.append(buf, n);
+    size_t pos;
+    while ((pos = user->inputBuffer.find('\n')) != string::npos ||
+           user->inputBuffer.size() > MAX_LINE) {
+        size_t len = pos == string::npos ? user->inputBuffer.size() : pos + 1;
+        lines.push_back(user->inputBuffer.substr(0, len));
+        user->inputBuffer.erase(0, len);
+        SessionCapture::recordLine(user->captureSession, user->id,
+                                   lines.back());
+    }
 }
 
-int shell(int fd) {
+// Read what the client sent and queue every complete line, return -1 when
+// the connection is closed
+int readInput(UserInfo *user, vector<string> &lines) {
     char buf[10000];
-    int n;
-    memset(buf, 0, sizeof(buf));
-    n = read(fd, buf, sizeof(buf));
+    int n = read(user->fd, buf, sizeof(buf));
+    serverStats->ioSyscalls++;
     if (n == 0) {
         return -1;
     } else if (n < 0) {
         cerr << "echo read: " << strerror(errno) << endl;
         return -1; // Return -1 on error
     }
+    splitInput(user, buf, n, lines);
+    return 0;
+}
 
-    string input(buf);
+// Run one input line, return -1 on exit
+int shell(UserInfo *user, string input) {
     input.erase(input.find_last_not_of(" \n\r\t") +
                 1); // remove trailing whitespace
-    // Redirect stdout, stderr
-    dup2(fd, STDOUT_FILENO);
-    dup2(fd, STDERR_FILENO);
-
-    // Get the current user
-    int userIndex = getUserIndex(fd);
-    UserInfo *user = &userList.at(userIndex);
-
-    // Clear the environment variables
-    clearenv();
-    // Set the environment variables for the user
-    for (auto &env : user->env) {
-        setenv(env.first.c_str(), env.second.c_str(), 1);
-    }
 
     if (input.empty()) {
-        cout << PROMPT << flush;
+        ProcessExecutor::sendMessage(user, PROMPT_BUFFER);
         return 0;
     } else if (input == "exit") {
         return -1;
     }
 
-    CommandParser parser(input, user->pipeManager, user, userList, userPipe);
+    CommandParser parser(input, user->pipeManager, user, *userList,
+                         *userPipe);
     parser.processCommands();
-    cout << PROMPT << flush;
+    ProcessExecutor::sendMessage(user, PROMPT_BUFFER);
     return 0;
 }
 
-int createSocket(int port) {
+int createSocket(int port, int backlog, bool reusePort) {
     int listenfd;
     struct sockaddr_in serv_addr;
     // Create listening socket
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         perror("server: can't open stream socket");
         exit(1); // Exit on critical errors
     }
@@ -96,6 +110,11 @@ int createSocket(int port) {
                    sizeof(optval)) < 0) {
         perror("setsockopt(SO_REUSEADDR) failed");
     }
+    // the kernel spreads new connections over every socket bound this way
+    if (reusePort && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                                sizeof(optval)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+    }
 
     // Bind the address
     if (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
@@ -105,7 +124,7 @@ int createSocket(int port) {
     }
 
     // Listen for connections
-    if (listen(listenfd, MAXUSER) < 0) { // Check listen return value
+    if (listen(listenfd, backlog) < 0) { // Check listen return value
         perror("server: listen error");
         close(listenfd);
         exit(1);
@@ -113,104 +132,712 @@ int createSocket(int port) {
     return listenfd;
 }
 
-void deleteUserPipe(int id) {
-    for (auto it = userPipe.begin(); it != userPipe.end();) {
-        pair idPair = it->first;
-        pair pipeFdPair = it->second;
-        // (read, write)
-        if (idPair.first == id || idPair.second == id) {
-            close(pipeFdPair.first);
-            close(pipeFdPair.second);
-            it = userPipe.erase(it); // Erase the entry and update the iterator
-        } else {
-            ++it; // Move to the next entry
+void runSession(Shard *shard);
+
+void userLogin(int ssock, const sockaddr_storage &clientAddr) {
+    if (!admission.admit(monotonicNs())) {
+        serverStats->rejected++;
+        AdmissionControl::reject(ssock, SERVER_BUSY_MESSAGE);
+        return;
+    }
+
+    string peer = peerName(ssock, clientAddr);
+
+    // Take the lowest available user ID
+    lock_guard<mutex> guard(userList->lock);
+    UserInfo *user = userList->login(ssock, peer);
+    if (user != nullptr) {
+        TcpOutput::setup(ssock);
+        Shard::timeouts.setupSocket(ssock);
+        if (SessionCapture::enabled()) {
+            user->captureSession = SessionCapture::newSession();
+            SessionCapture::record(SessionCapture::OPEN, user->captureSession,
+                                   user->id, user->ipPort);
+        }
+        // the owning shard polls the socket from now on
+        Shard *shard =
+            Shard::perSession ? Shard::openSession(user) : Shard::of(user);
+        shard->attach(user, WELCOME_BUFFER);
+        if (Shard::perSession) {
+            thread(runSession, shard).detach();
         }
+        string msg = "*** User '" + user->name + "' entered from " +
+                     user->ipPort + ". ***\n";
+        ProcessExecutor::broadcastMessage(msg);
+        ProcessExecutor::sendMessage(user, PROMPT_BUFFER);
+        return;
     }
+    // every slot is taken, don't keep a socket nobody polls
+    serverStats->rejected++;
+    AdmissionControl::reject(ssock, SERVER_FULL_MESSAGE);
 }
 
-void userLogin(int msock, fd_set &afds) {
-    struct sockaddr_in clientAddr;
+void acceptUser(int msock) {
+    struct sockaddr_storage clientAddr;
     socklen_t alen = sizeof(clientAddr);
-    int ssock = accept(msock, (struct sockaddr *)&clientAddr, &alen);
+    int ssock =
+        accept4(msock, (struct sockaddr *)&clientAddr, &alen, SOCK_CLOEXEC);
+    serverStats->ioSyscalls++;
     if (ssock < 0) {
         cerr << "accept: " << strerror(errno) << endl;
+        return;
     }
-    FD_SET(ssock, &afds);
+    userLogin(ssock, clientAddr);
+}
 
-    char ipBuf[INET_ADDRSTRLEN];
-    string ip = inet_ntoa(clientAddr.sin_addr);
-    string clientIP =
-        inet_ntop(AF_INET, &clientAddr.sin_addr, ipBuf, sizeof(clientIP));
-    string clientPort = to_string(ntohs(clientAddr.sin_port));
-    write(ssock, WELCOME_MESSAGE.c_str(), WELCOME_MESSAGE.size());
+void userLogout(UserInfo *user) {
+    int fd = user->fd;
+    // deliver what is still queued before the socket closes
+    ProcessExecutor::flushOutput();
+    Shard::current->detach(user);
+    {
+        lock_guard<mutex> guard(userList->lock);
+        int id = user->id;
+        SessionCapture::record(SessionCapture::CLOSE, user->captureSession,
+                               id);
+        string msg = "*** User '" + user->name + "' left. ***\n";
+        // logout first (can't send message to the user who left)
+        userList->logout(user);
+        userPipe->removeUser(id);
+        ProcessExecutor::broadcastMessage(msg);
+    }
+    shutdown(fd, SHUT_RDWR); // close telnet
+    close(fd);
+}
 
-    // Find the first available user slot
-    for (int idx = 1; idx <= MAXUSER; idx++) {
-        if (!userList[idx].isLogin) {
-            PipeManager pipeManager;
-            userList[idx].isLogin = true;
-            userList[idx].id = idx;
-            userList[idx].ipPort = clientIP + ":" + clientPort;
-            userList[idx].fd = ssock;
-            userList[idx].pipeManager = pipeManager;
-            string msg = "*** User '" + userList[idx].name + "' entered from " +
-                         userList[idx].ipPort + ". ***\n";
-            ProcessExecutor::broadcastMessage(msg, userList);
-            break;
+// Deficit round-robin over the users of one shard. Builtins such as tell,
+// yell and who never wait behind external commands. External pipelines are
+// charged one credit per stage and held back while the user already has
+// maxStages children running.
+class CommandScheduler {
+    deque<UserInfo *> active; // users with pending lines, in DRR order
+    vector<pair<UserInfo *, unsigned>> corked; // user, serial when corked
+
+    static bool isBuiltinLine(const string &line) {
+        static const set<string> builtins = {
+            "exit",  "setenv", "printenv", "who",
+            "stats", "tell",   "yell",     "name"};
+        stringstream ss(line);
+        string cmd;
+        return !(ss >> cmd) || builtins.count(cmd) > 0;
+    }
+
+    static int stageCount(const string &line) {
+        stringstream ss(line);
+        string token;
+        int stages = 1;
+        while (ss >> token) {
+            if (token[0] == '|' || token[0] == '!') {
+                stages++;
+            }
         }
+        return stages;
+    }
+
+    bool mayLaunch(UserInfo *user, int cost) const {
+        int live = user->sched.liveStages;
+        // a line reading a pending numbered pipe drains a running stage,
+        // holding it back could block the writer forever
+        return maxStages == 0 || live == 0 || live + cost <= maxStages ||
+               user->pipeManager.hasPipe(0);
+    }
+
+    // The line reads a bulk user pipe whose writer still runs. It waits
+    // here rather than in the shell, which would stall the whole shard:
+    // the sender's shard wakes ours once the pipe is sealed or dropped.
+    static bool awaitsBulkPipe(const UserInfo *user, const string &line) {
+        if (!BulkPipe::enabled() || line.find('<') == string::npos) {
+            return false;
+        }
+        stringstream ss(line);
+        string token;
+        lock_guard<mutex> guard(userList->lock);
+        while (ss >> token) {
+            if (token.size() > 1 && token[0] == '<' && isdigit(token[1]) &&
+                userPipe->writing(user->id, atoi(token.c_str() + 1))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool runnable(UserInfo *user) const {
+        if (user->pendingLines.empty()) {
+            return false;
+        }
+        const string &line = user->pendingLines.front().text;
+        return isBuiltinLine(line) || (mayLaunch(user, stageCount(line)) &&
+                                       !awaitsBulkPipe(user, line));
+    }
+
+    // Run the first pending line, false once the user has left
+    bool runHead(UserInfo *user) {
+        PendingLine line = std::move(user->pendingLines.front());
+        user->pendingLines.pop_front();
+        user->sched.queued--;
+        long waitUs = chrono::duration_cast<chrono::microseconds>(
+                          chrono::steady_clock::now() - line.queuedAt)
+                          .count();
+        user->sched.linesRun++;
+        user->sched.waitUsTotal += waitUs;
+        if (waitUs > user->sched.waitUsMax) {
+            user->sched.waitUsMax = waitUs;
+        }
+        if (TcpOutput::mode == TcpOutput::CORK) {
+            // child output and the prompt leave together at the next flush
+            TcpOutput::cork(user->fd);
+            corked.push_back({user, user->serial});
+        }
+        uint64_t start = monotonicNs();
+        int status = shell(user, line.text);
+        serverStats->shellNs.record(monotonicNs() - start);
+        if (status == -1) {
+            leave(user);
+            return false;
+        }
+        return true;
+    }
+
+  public:
+    int quantum = 4;   // stages credited per round
+    int maxStages = 0; // concurrent children per user, 0 is unlimited
+
+    // Log out now, lines still queued are dropped
+    void leave(UserInfo *user) {
+        forget(user);
+        userLogout(user);
     }
-    write(ssock, PROMPT, strlen(PROMPT));
+
+    void enqueue(UserInfo *user, string line) {
+        user->pendingLines.push_back({std::move(line), chrono::steady_clock::now()});
+        user->sched.queued++;
+        if (!user->scheduled) {
+            user->scheduled = true;
+            active.push_back(user);
+        }
+    }
+
+    // After the flush, release what runHead corked this iteration
+    void uncorkAll() {
+        for (auto &[user, serial] : corked) {
+            if (user->attached && user->serial == serial) {
+                TcpOutput::uncork(user->fd);
+            }
+        }
+        corked.clear();
+    }
+
+    void forget(UserInfo *user) {
+        if (user->scheduled) {
+            active.erase(find(active.begin(), active.end(), user));
+            user->scheduled = false;
+        }
+    }
+
+    // Peer closed the connection: run what is queued, then log out
+    void close(UserInfo *user) {
+        if (user->pendingLines.empty()) {
+            leave(user);
+            return;
+        }
+        user->closing = true;
+        Shard::current->unwatch(user);
+    }
+
+    bool hasRunnable() const {
+        for (UserInfo *user : active) {
+            if (runnable(user)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // One pass of builtins for everyone, then one DRR round
+    void runRound() {
+        vector<UserInfo *> users(active.begin(), active.end());
+        for (UserInfo *user : users) {
+            while (user->attached && !user->pendingLines.empty() &&
+                   isBuiltinLine(user->pendingLines.front().text)) {
+                if (!runHead(user)) {
+                    break;
+                }
+            }
+        }
+
+        size_t turns = active.size();
+        while (turns-- > 0 && !active.empty()) {
+            UserInfo *user = active.front();
+            active.pop_front();
+            user->scheduled = false;
+            if (runnable(user)) {
+                user->deficit += quantum;
+            }
+            bool online = true;
+            while (online && runnable(user)) {
+                const string &line = user->pendingLines.front().text;
+                int cost = isBuiltinLine(line) ? 0 : stageCount(line);
+                if (cost > user->deficit) {
+                    break;
+                }
+                user->deficit -= cost;
+                online = runHead(user);
+            }
+            if (!online) {
+                continue;
+            }
+            if (user->pendingLines.empty()) {
+                user->deficit = 0;
+                if (user->closing) {
+                    userLogout(user);
+                }
+                continue;
+            }
+            user->scheduled = true;
+            active.push_back(user);
+        }
+    }
+};
+
+vector<CommandScheduler> schedulers; // one per shard
+atomic<bool> reportRequested{false};
+
+// SIGUSR1: ask shard 0 to print the stats and scheduler report
+void requestReport(int) {
+    reportRequested = true;
+    uint64_t one = 1;
+    write(Shard::all[0]->doorbell, &one, sizeof(one));
 }
 
-void userLogout(int fd) {
-    // Find the user index
-    int userIndex = getUserIndex(fd);
-    if (userIndex != -1) {
-        userList[userIndex].isLogin =
-            false; // logout (can't send message to the user who left)
-        string msg = "*** User '" + userList[userIndex].name + "' left. ***\n";
-        ProcessExecutor::broadcastMessage(msg, userList);
-        initUserInfos(userIndex);
-        deleteUserPipe(userIndex);
+// Server stats, then per-user queue and wait times, for the operator
+void printSchedulerReport() {
+    cerr << statsReport(*userList);
+    lock_guard<mutex> guard(userList->lock);
+    cerr << "<ID>\t<nickname>\t<queued>\t<run>\t<avg wait ms>\t<max wait "
+            "ms>\t<live stages>\n";
+    for (int id : userList->online()) {
+        UserInfo *user = userList->byId(id);
+        long run = user->sched.linesRun;
+        double avg = run ? user->sched.waitUsTotal / 1000.0 / run : 0;
+        cerr << id << "\t" << user->name << "\t" << user->sched.queued
+             << "\t" << run << "\t" << avg << "\t"
+             << user->sched.waitUsMax / 1000.0 << "\t"
+             << user->sched.liveStages << "\n";
     }
+    cerr << flush;
 }
 
-int main(int argc, char *argv[]) {
-    struct sockaddr_in clientAddr;
-    int SERV_TCP_PORT = std::atoi(argv[1]);
-    fd_set rfds, afds;
-    socklen_t alen;
-    int nfds;
-    int msock = createSocket(SERV_TCP_PORT);
-    nfds = FD_SETSIZE;
-    FD_ZERO(&afds);
-    FD_SET(msock, &afds);
-    for (int i = 1; i <= MAXUSER; i++) {
-        initUserInfos(i);
+// A session timer fired. Users with queued lines or running children are
+// not idle, they get a fresh idle period instead.
+void expireSession(CommandScheduler &scheduler, TimerNode *timer) {
+    UserInfo *user = (UserInfo *)timer->owner;
+    string reason;
+    if (timer == &user->loginTimer) {
+        reason = "login time limit reached";
+    } else if (user->pendingLines.empty() && user->sched.liveStages == 0) {
+        reason = "idle for too long";
+    } else {
+        Shard::current->touch(user);
+        return;
     }
-    signal(SIGCHLD, SIG_IGN);
+    ProcessExecutor::sendMessage(user,
+                                 makeBuffer("*** Session closed: " + reason +
+                                            ". ***\n"));
+    scheduler.leave(user);
+}
+
+// One epoll wakeup: accept, drain mail, reap children and read input.
+// Returns the number of ready fds, -1 when interrupted.
+int pollEpoll(Shard *shard, CommandScheduler &scheduler, int msock,
+              int timeout, uint64_t &wakeup) {
+    epoll_event events[64];
+    vector<string> lines;
+    int n = epoll_wait(shard->epfd, events, 64, timeout);
+    serverStats->ioSyscalls++;
+    if (n < 0) {
+        if (errno != EINTR) {
+            cerr << "Error in epoll_wait, errno: " << errno << endl;
+        }
+        return -1; // may be interrupted by signal -> wait again
+    }
+    wakeup = monotonicNs();
+    for (int i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+        if (ptr == nullptr) {
+            acceptUser(msock);
+        } else if (ptr == &unixSock) {
+            acceptUser(unixSock);
+        } else if (ptr == shard) {
+            shard->drain();
+        } else if (ptr == &shard->childEpfd) {
+            shard->reapChildren();
+        } else {
+            UserInfo *user = (UserInfo *)ptr;
+            if (!user->attached || user->closing) {
+                continue; // left earlier in this batch
+            }
+            lines.clear();
+            shard->touch(user);
+            int status = readInput(user, lines);
+            for (string &line : lines) {
+                scheduler.enqueue(user, std::move(line));
+            }
+            if (status == -1) { // connection closed
+                scheduler.close(user);
+            }
+        }
+    }
+    return n;
+}
+
+// Input of a session from its multishot recv. Completions of an earlier
+// login of the same slot only give their buffer back.
+void handleRecv(Shard *shard, CommandScheduler &scheduler,
+                const io_uring_cqe &cqe, vector<string> &lines) {
+    IoUring *ring = shard->ring;
+    UserInfo *user = (UserInfo *)Shard::ringLow(cqe.user_data);
+    uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    bool live = user->attached && !user->closing &&
+                (user->serial & 0xff) == Shard::ringSerial(cqe.user_data);
+    if (live && cqe.res > 0) {
+        lines.clear();
+        shard->touch(user);
+        splitInput(user, ring->buffer(bid), cqe.res, lines);
+        for (string &line : lines) {
+            scheduler.enqueue(user, std::move(line));
+        }
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        ring->recycle(bid);
+    }
+    if (!live || (cqe.flags & IORING_CQE_F_MORE)) {
+        return;
+    }
+    if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+        shard->watchRing(user); // kernel stopped the multishot, read on
+        return;
+    }
+    // unlike read(), the recv stays armed after `exit` was queued, so a
+    // client closing with unread output shows up here as a reset
+    if (cqe.res < 0 && cqe.res != -ECONNRESET) {
+        cerr << "echo read: " << strerror(-cqe.res) << endl;
+    }
+    scheduler.close(user); // connection closed
+}
+
+// One io_uring wakeup: submit what was prepared, wait, then handle every
+// completion. Multishot requests the kernel ended are armed again.
+int pollRing(Shard *shard, CommandScheduler &scheduler, int timeout,
+             uint64_t &wakeup) {
+    IoUring *ring = shard->ring;
+    // completions set aside by the last flush are ready already
+    int ret = ring->submitAndWait(shard->hasDeferred() ? 0 : 1, timeout);
+    if (ret < 0) {
+        if (ret != -EINTR) {
+            cerr << "io_uring_enter: " << strerror(-ret) << endl;
+        }
+        return -1;
+    }
+    wakeup = monotonicNs();
+    vector<string> lines;
+    io_uring_cqe cqe;
+    int events = 0;
+    while (shard->nextCompletion(cqe)) {
+        events++;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        switch (Shard::ringOp(cqe.user_data)) {
+        case Shard::RING_RECV:
+            handleRecv(shard, scheduler, cqe, lines);
+            break;
+        case Shard::RING_ACCEPT:
+            if (cqe.res >= 0) {
+                sockaddr_storage addr = {};
+                socklen_t alen = sizeof(addr);
+                getpeername(cqe.res, (sockaddr *)&addr, &alen);
+                serverStats->ioSyscalls++;
+                userLogin(cqe.res, addr);
+            } else {
+                cerr << "accept: " << strerror(-cqe.res) << endl;
+            }
+            if (!more) {
+                ring->prepAcceptMultishot(Shard::ringLow(cqe.user_data),
+                                          cqe.user_data);
+            }
+            break;
+        case Shard::RING_DOORBELL:
+            shard->drain();
+            if (!more) {
+                ring->prepPollMultishot(shard->doorbell, cqe.user_data);
+            }
+            break;
+        case Shard::RING_CHILDREN:
+            shard->reapChildren();
+            if (!more) {
+                ring->prepPollMultishot(shard->childEpfd, cqe.user_data);
+            }
+            break;
+        default:
+            break; // cancellations
+        }
+    }
+    return events;
+}
+
+// Replace epoll with io_uring for this shard, unless the kernel can't
+void setupRing(Shard *shard, int msock) {
+    IoUring *ring = new IoUring;
+    if (!ring->init(256)) {
+        cerr << "shard " << shard->index
+             << ": io_uring unavailable, using epoll" << endl;
+        delete ring;
+        return;
+    }
+    shard->ring = ring;
+    ring->setupBuffers(0, 256, 8192);
+    if (msock >= 0) {
+        ring->prepAcceptMultishot(msock,
+                                  Shard::ringTag(Shard::RING_ACCEPT, msock));
+    }
+    if (shard->index == 0 && msock >= 0 && unixSock >= 0) {
+        ring->prepAcceptMultishot(
+            unixSock, Shard::ringTag(Shard::RING_ACCEPT, unixSock));
+    }
+    ring->prepPollMultishot(shard->doorbell,
+                            Shard::ringTag(Shard::RING_DOORBELL, 0));
+    // children are still watched by pidfd in childEpfd, the ring polls it
+    ring->prepPollMultishot(shard->childEpfd,
+                            Shard::ringTag(Shard::RING_CHILDREN, 0));
+}
+
+// Poll, run and flush until untilIdle and the shard has no session left
+void runLoop(Shard *shard, CommandScheduler &scheduler, int msock,
+             bool untilIdle) {
+    uint64_t enters = 0; // of the ring, already in the stats
     while (1) {
-        memcpy(&rfds, &afds, sizeof(rfds));
-        if (select(nfds, &rfds, NULL, NULL, NULL) < 0) {
-            if (errno != EINTR) {
-                cerr << "Error in select, errno: " << errno << endl;
-            }
-            continue; // may be interrupted by signal or other errors -> select
-                      // again
-        }
-        if (FD_ISSET(msock, &rfds)) {
-            userLogin(msock, afds);
-        }
-        for (int fd = 0; fd < nfds; ++fd) {
-            if (fd != msock && FD_ISSET(fd, &rfds)) {
-                int status = shell(fd);
-                if (status == -1) { // exit
-                    userLogout(fd);
-                    shutdown(fd, SHUT_RDWR); // close telnet
-                    close(fd);
-                    FD_CLR(fd, &afds);
-                }
+        // don't sleep while the scheduler still has lines it may run
+        int timeout = scheduler.hasRunnable()
+                          ? 0
+                          : shard->timers.timeoutMs(monotonicNs() / 1000000);
+        uint64_t wakeup = 0;
+        int n = shard->ring
+                    ? pollRing(shard, scheduler, timeout, wakeup)
+                    : pollEpoll(shard, scheduler, msock, timeout, wakeup);
+        if (n < 0) {
+            continue;
+        }
+        serverStats->eventsPerWakeup.record(n);
+        shard->timers.advance(monotonicNs() / 1000000, [&](TimerNode *timer) {
+            expireSession(scheduler, timer);
+        });
+        scheduler.runRound();
+        if (shard->index == 0 && reportRequested.exchange(false)) {
+            printSchedulerReport();
+        }
+        // one writev per client for everything produced in this iteration
+        ProcessExecutor::flushOutput();
+        scheduler.uncorkAll();
+        if (untilIdle && shard->idle()) {
+            return; // the last session has left
+        }
+        if (shard->ring) {
+            serverStats->ioSyscalls += shard->ring->enters - enters;
+            enters = shard->ring->enters;
+        }
+        serverStats->loopNs.record(monotonicNs() - wakeup);
+    }
+}
+
+// Event loop of one shard. Shard 0 runs on the main thread and also accepts
+// new connections, with --reuseport every shard accepts on its own socket.
+// The shard accepting TCP connections takes --unix ones too.
+void runShard(Shard *shard, int msock) {
+    Shard::current = shard;
+    if (options.ioUring) {
+        setupRing(shard, msock);
+    }
+    if (shard->ring == nullptr && msock >= 0) {
+        epoll_event ev = {.events = EPOLLIN, .data = {.ptr = nullptr}};
+        epoll_ctl(shard->epfd, EPOLL_CTL_ADD, msock, &ev);
+    }
+    if (shard->ring == nullptr && shard->index == 0 && msock >= 0 &&
+        unixSock >= 0) {
+        epoll_event ev = {.events = EPOLLIN, .data = {.ptr = &unixSock}};
+        epoll_ctl(shard->epfd, EPOLL_CTL_ADD, unixSock, &ev);
+    }
+    runLoop(shard, schedulers[shard->index], msock, options.exitWhenEmpty);
+}
+
+// A thread of --model session: the shard of one session, with a scheduler
+// of its own. Started at login, it ends once the user has logged out.
+void runSession(Shard *shard) {
+    Shard::current = shard;
+    CommandScheduler scheduler;
+    scheduler.quantum = options.quantum;
+    scheduler.maxStages = options.maxStages;
+    if (options.ioUring) {
+        setupRing(shard, -1);
+    }
+    shard->drain(); // the ATTACH userLogin posted, before the first poll
+    ProcessExecutor::flushOutput();
+    runLoop(shard, scheduler, -1, true);
+    Shard::closeSession(shard);
+}
+
+void parseOptions(int argc, char *argv[]) {
+    static const option longOptions[] = {
+        {"max-users", required_argument, nullptr, 'u'},
+        {"threads", required_argument, nullptr, 't'},
+        {"quantum", required_argument, nullptr, 'q'},
+        {"max-stages", required_argument, nullptr, 's'},
+        {"rlimit-cpu", required_argument, nullptr, 'c'},
+        {"rlimit-as", required_argument, nullptr, 'a'},
+        {"rlimit-nproc", required_argument, nullptr, 'n'},
+        {"capture", required_argument, nullptr, 'C'},
+        {"tcp-output", required_argument, nullptr, 'o'},
+        {"idle-timeout", required_argument, nullptr, 'i'},
+        {"login-limit", required_argument, nullptr, 'l'},
+        {"keepalive", required_argument, nullptr, 'k'},
+        {"backlog", required_argument, nullptr, 'b'},
+        {"accept-rate", required_argument, nullptr, 'r'},
+        {"accept-burst", required_argument, nullptr, 'B'},
+        {"reuseport", no_argument, nullptr, 'R'},
+        {"unix", required_argument, nullptr, 'U'},
+        {"io", required_argument, nullptr, 'I'},
+        {"bulk-pipes", required_argument, nullptr, 'p'},
+        {nullptr, 0, nullptr, 0},
+    };
+    string usage = "Usage: " + string(argv[0]) +
+                   " [--max-users N] [--threads N] [--quantum N]"
+                   " [--max-stages N] [--rlimit-cpu SEC] [--rlimit-as MB]"
+                   " [--rlimit-nproc N] [--capture FILE]"
+                   " [--tcp-output nagle|nodelay|cork] [--idle-timeout SEC]"
+                   " [--login-limit SEC] [--keepalive SEC] [--backlog N]"
+                   " [--accept-rate N] [--accept-burst N] [--reuseport]"
+                   " [--unix PATH|@NAME] [--io epoll|uring]"
+                   " [--bulk-pipes BYTES] port";
+    int opt;
+    while ((opt = getopt_long(argc, argv,
+                              "u:t:q:s:c:a:n:C:o:i:l:k:b:r:B:RU:I:p:",
+                              longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case 'u':
+            options.maxUser = max(1, atoi(optarg));
+            break;
+        case 't':
+            options.threads = max(1, atoi(optarg));
+            break;
+        case 'q':
+            options.quantum = max(1, atoi(optarg));
+            break;
+        case 's':
+            options.maxStages = max(0, atoi(optarg));
+            break;
+        case 'c':
+            ProcessExecutor::limits.cpuSeconds = atol(optarg);
+            break;
+        case 'a':
+            ProcessExecutor::limits.addressSpace = atol(optarg) << 20;
+            break;
+        case 'n':
+            ProcessExecutor::limits.processes = atol(optarg);
+            break;
+        case 'C':
+            if (!SessionCapture::open(optarg)) {
+                perror("capture");
+                exit(1);
+            }
+            break;
+        case 'o':
+            if (!TcpOutput::parse(optarg)) {
+                cerr << usage << endl;
+                exit(1);
+            }
+            break;
+        case 'i':
+            Shard::timeouts.idleMs = max(0L, atol(optarg)) * 1000;
+            break;
+        case 'l':
+            Shard::timeouts.loginMs = max(0L, atol(optarg)) * 1000;
+            break;
+        case 'k':
+            Shard::timeouts.keepalive = max(0, atoi(optarg));
+            break;
+        case 'b':
+            options.backlog = max(1, atoi(optarg));
+            break;
+        case 'r':
+            admission.rate = max(0.0, atof(optarg));
+            break;
+        case 'B':
+            admission.burst = max(0.0, atof(optarg));
+            break;
+        case 'R':
+            options.reusePort = true;
+            break;
+        case 'U':
+            options.unixPath = optarg;
+            break;
+        case 'I':
+            if (string(optarg) != "epoll" && string(optarg) != "uring") {
+                cerr << usage << endl;
+                exit(1);
             }
+            options.ioUring = string(optarg) == "uring";
+            break;
+        case 'p':
+            BulkPipe::limit = max(0L, atol(optarg));
+            break;
+        default:
+            cerr << usage << endl;
+            exit(1);
         }
     }
-}
\ No newline at end of file
+    if (optind >= argc) {
+        cerr << usage << endl;
+        exit(1);
+    }
+    options.port = atoi(argv[optind]);
+}
+
+// Directory, pipe registry and one shard plus scheduler per thread
+void createShards() {
+    userList = new UserDirectory(options.maxUser);
+    userPipe = new UserPipeRegistry(options.maxUser);
+    for (int i = 0; i < options.threads; i++) {
+        Shard::all.push_back(new Shard(i));
+        schedulers.emplace_back();
+        schedulers.back().quantum = options.quantum;
+        schedulers.back().maxStages = options.maxStages;
+    }
+}
+
+// Start the other reactors, shard 0 runs on the calling thread
+void runShards(int msock) {
+    signal(SIGUSR1, requestReport);
+    vector<thread> reactors;
+    for (int i = 1; i < options.threads; i++) {
+        int shardSock = -1;
+        if (options.reusePort) {
+            shardSock = createSocket(options.port, options.backlog, true);
+        }
+        reactors.emplace_back(runShard, Shard::all[i], shardSock);
+    }
+    runShard(Shard::all[0], msock);
+}
+
+// np_server.cpp reuses everything above with a main of its own
+#ifndef NP_SINGLE_PROC_NO_MAIN
+int main(int argc, char *argv[]) {
+    parseOptions(argc, argv);
+    int msock = createSocket(options.port, options.backlog, options.reusePort);
+    if (!options.unixPath.empty()) {
+        unixSock = createUnixSocket(options.unixPath, options.backlog);
+        if (unixSock < 0) {
+            exit(1);
+        }
+    }
+    signal(SIGCHLD, SIG_IGN);
+    createShards();
+    runShards(msock);
+}
+#endif
@@ -1,44 +1,187 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <ctype.h>
+#include <deque>
 #include <fcntl.h>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <set>
+#include <signal.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
+
+#include "bulk_pipe.cpp"
+#include "io_uring.cpp"
+#include "server_stats.cpp"
+#include "timer_wheel.cpp"
 #define MAXUSER 30
 using namespace std;
 
 #define USER_PIPE_IN 0
+#define TIMER_TICK_MS 250
+
+// Pending user pipes, keyed by (receiver, sender). Lookups go through one
+// hash table keyed by the packed ID pair, and every user keeps an adjacency
+// list of the peers it shares a pipe with, so logout only visits its own
+// pipes instead of the whole table. Guarded by UserDirectory::lock.
+class UserPipeRegistry {
+  public:
+    struct Fds {
+        int readFd;
+        int writeFd;     // -1 for a bulk pipe, see bulk_pipe.cpp
+        off_t bytes = 0; // in a sealed bulk pipe
+        bool writing = false; // bulk pipe whose writer is still running
+    };
+
+  private:
+    // splitmix64 finalizer, spreads both IDs over every bit of the hash
+    struct KeyHash {
+        size_t operator()(uint64_t key) const {
+            key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+            return key ^ (key >> 31);
+        }
+    };
+
+    unordered_map<uint64_t, Fds, KeyHash> pipes;
+    vector<vector<int>> peers; // user ID -> other end of each of its pipes
+    vector<off_t> held;        // sender ID -> bytes in its sealed bulk pipes
+
+    static uint64_t key(int recvId, int sendId) {
+        return (uint64_t)(uint32_t)recvId << 32 | (uint32_t)sendId;
+    }
+
+    void unlinkPeer(int id, int peer) {
+        vector<int> &list = peers[id];
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i] == peer) {
+                list[i] = list.back();
+                list.pop_back();
+                return;
+            }
+        }
+    }
+
+  public:
+    explicit UserPipeRegistry(int capacity)
+        : peers(capacity + 1), held(capacity + 1) {
+        pipes.reserve(capacity);
+    }
+
+    size_t size() const { return pipes.size(); }
 
-// For unordered_map<pair<int, int>, pair<int, int>, pair_hash> userPipe;
-struct pair_hash {
-    size_t operator()(const pair<int, int> &p) const {
-        return hash<int>()(p.first) ^ (hash<int>()(p.second) << 1);
+    bool contains(int recvId, int sendId) const {
+        return pipes.count(key(recvId, sendId)) > 0;
+    }
+
+    void add(int recvId, int sendId, Fds fds) {
+        pipes[key(recvId, sendId)] = fds;
+        peers[recvId].push_back(sendId);
+        peers[sendId].push_back(recvId);
+    }
+
+    off_t heldBy(int sendId) const { return held[sendId]; }
+
+    // A bulk pipe whose writer still runs: lines reading it wait for the
+    // seal instead of a reactor thread, see CommandScheduler::runnable()
+    bool writing(int recvId, int sendId) const {
+        auto it = pipes.find(key(recvId, sendId));
+        return it != pipes.end() && it->second.writing;
+    }
+
+    // The writer of a bulk pipe exited, fd is its own copy of the memfd and
+    // heldBefore what the sender held when it started. False when it went
+    // over the room it had, the pipe is dropped then. Nothing to do when
+    // the receiver left meanwhile.
+    bool seal(int recvId, int sendId, int fd, off_t heldBefore) {
+        auto it = pipes.find(key(recvId, sendId));
+        if (it == pipes.end() || !it->second.writing) {
+            return true;
+        }
+        off_t bytes = BulkPipe::seal(fd);
+        if (BulkPipe::overrun(bytes, heldBefore)) {
+            close(it->second.readFd);
+            pipes.erase(it);
+            unlinkPeer(recvId, sendId);
+            unlinkPeer(sendId, recvId);
+            return false;
+        }
+        it->second.bytes = bytes;
+        it->second.writing = false;
+        held[sendId] += bytes;
+        return true;
+    }
+
+    // Remove the pipe and hand its fds to the caller, false when there is
+    // none or its writer still runs
+    bool take(int recvId, int sendId, Fds &fds) {
+        auto it = pipes.find(key(recvId, sendId));
+        if (it == pipes.end() || it->second.writing) {
+            return false;
+        }
+        fds = it->second;
+        held[sendId] -= fds.bytes;
+        pipes.erase(it);
+        unlinkPeer(recvId, sendId);
+        unlinkPeer(sendId, recvId);
+        return true;
+    }
+
+    // Close every pipe the user sends or receives on
+    void removeUser(int id) {
+        for (int peer : peers[id]) {
+            for (uint64_t k : {key(id, peer), key(peer, id)}) {
+                auto it = pipes.find(k);
+                if (it != pipes.end()) {
+                    close(it->second.readFd);
+                    if (it->second.writeFd >= 0) {
+                        close(it->second.writeFd);
+                    }
+                    held[k == key(id, peer) ? peer : id] -= it->second.bytes;
+                    pipes.erase(it);
+                }
+            }
+            if (peer != id) {
+                unlinkPeer(peer, id);
+            }
+        }
+        peers[id].clear();
     }
 };
 
-// No change in single_proc
+// One user's numbered pipes, used only by the thread running that user's line
 class PipeManager {
 
   public:
     unordered_map<int, int[2]> active_pipes;
-    void createPipe(int pipe_id) {
+    // False, with errno set, when pipe2 fails. Nothing waits for fds here:
+    // the shard's other sessions would stall with it.
+    bool createPipe(int pipe_id) {
         int pipe_fds[2];
-        while (pipe(pipe_fds) == -1) {
-            if (errno == EMFILE || errno == ENFILE) {
-                wait(nullptr);
-            }
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            return false;
         }
         active_pipes[pipe_id][0] = pipe_fds[0];
         active_pipes[pipe_id][1] = pipe_fds[1];
+        return true;
     }
 
     bool hasPipe(int pipe_id) const { return active_pipes.count(pipe_id) > 0; }
@@ -55,15 +198,754 @@ class PipeManager {
     }
 };
 
+// Immutable message body. A broadcast is encoded once and every recipient's
+// OutputQueue holds a reference to the same buffer.
+using SharedBuffer = shared_ptr<const string>;
+
+inline SharedBuffer makeBuffer(string msg) {
+    return make_shared<const string>(std::move(msg));
+}
+
+// Pending output of one client. Messages and the prompt are queued here and
+// written out together by a single writev per flush.
+class OutputQueue {
+    deque<SharedBuffer> pending;
+    size_t offset = 0; // bytes of pending.front() already written
+
+  public:
+    static const int MAX_IOV = 64; // buffers per sendmsg
+    bool scheduled = false; // already on the dirty list of ProcessExecutor
+
+    void push(SharedBuffer buf) {
+        if (!buf->empty()) {
+            pending.push_back(std::move(buf));
+        }
+    }
+
+    bool empty() const { return pending.empty(); }
+
+    // Hand everything pending over to an asynchronous writer, skip is what
+    // was already written of the first buffer
+    void takeAll(vector<SharedBuffer> &out, size_t &skip) {
+        out.assign(pending.begin(), pending.end());
+        skip = offset;
+        clear();
+    }
+
+    void clear() {
+        pending.clear();
+        offset = 0;
+    }
+
+    // Write all pending buffers to fd, return the number of writev calls
+    int flush(int fd) {
+        int calls = 0;
+        while (!pending.empty()) {
+            iovec iov[MAX_IOV];
+            int cnt = 0;
+            for (auto it = pending.begin();
+                 it != pending.end() && cnt < MAX_IOV; ++it, ++cnt) {
+                size_t skip = cnt == 0 ? offset : 0;
+                iov[cnt].iov_base = (void *)((*it)->data() + skip);
+                iov[cnt].iov_len = (*it)->size() - skip;
+            }
+            // writev semantics, without SIGPIPE when the client is gone
+            msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            calls++;
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                clear(); // client is gone, drop its output
+                break;
+            }
+            offset += n;
+            while (!pending.empty() && offset >= pending.front()->size()) {
+                offset -= pending.front()->size();
+                pending.pop_front();
+            }
+        }
+        return calls;
+    }
+};
+
+// Environment of one user. The envp block handed to execve is built once and
+// shared until the next setenv replaces it (copy-on-write), so the global
+// environ of the server is never touched.
+class UserEnv {
+  public:
+    struct Block {
+        vector<string> entries; // "NAME=value"
+        vector<char *> envp;    // points into entries, nullptr terminated
+    };
+
+  private:
+    map<string, string> vars;
+    mutable shared_ptr<const Block> block; // nullptr until next envp()
+
+  public:
+    void set(const string &name, const string &value) {
+        vars[name] = value;
+        block.reset();
+    }
+
+    const string *get(const string &name) const {
+        auto it = vars.find(name);
+        return it == vars.end() ? nullptr : &it->second;
+    }
+
+    void clear() {
+        vars.clear();
+        block.reset();
+    }
+
+    shared_ptr<const Block> envp() const {
+        if (!block) {
+            auto fresh = make_shared<Block>();
+            fresh->entries.reserve(vars.size());
+            for (const auto &[name, value] : vars) {
+                fresh->entries.push_back(name + "=" + value);
+            }
+            for (string &entry : fresh->entries) {
+                fresh->envp.push_back(entry.data());
+            }
+            fresh->envp.push_back(nullptr);
+            block = std::move(fresh);
+        }
+        return block;
+    }
+};
+
+// A complete input line waiting for the command scheduler
+struct PendingLine {
+    string text;
+    chrono::steady_clock::time_point queuedAt;
+};
+
+// Per-user scheduler counters, read by the operator report from any thread
+struct SchedulerStats {
+    atomic<long> linesRun{0};
+    atomic<long> waitUsTotal{0};
+    atomic<long> waitUsMax{0};
+    atomic<int> queued{0};
+    atomic<int> liveStages{0}; // children still running
+
+    void reset() {
+        linesRun = 0;
+        waitUsTotal = 0;
+        waitUsMax = 0;
+        queued = 0;
+        liveStages = 0;
+    }
+};
+
+class Shard;
+
 struct UserInfo {
     bool isLogin; // check if the user is login
     int id;       // range from 1 to 30
     string name;
     string ipPort;
     int fd;
-    unordered_map<string, string> env; // [var] [value] (e.g. [PATH] [bin:.])
+    UserEnv env;                       // [var] [value] (e.g. [PATH] [bin:.])
     int cmdCount;                      // count the number of commands
     PipeManager pipeManager;           // store numbered pipe
+    OutputQueue output;                // messages waiting for next flush
+    unsigned serial = 0;               // bumped on every login of this slot
+    bool attached = false;             // session is polled by its shard
+    string inputBuffer;                // bytes after the last full line
+    deque<PendingLine> pendingLines;   // read but not yet run
+    long deficit = 0;                  // DRR credit, in pipeline stages
+    bool scheduled = false;            // on the scheduler's active list
+    bool closing = false;              // peer closed, leave once drained
+    SchedulerStats sched;
+    uint32_t captureSession = 0;       // session ID in the capture file
+    TimerNode idleTimer;               // re-armed by every read
+    TimerNode loginTimer;              // session length limit
+    Shard *shard = nullptr;            // own shard of --model session
+};
+
+// Online users. Slots are indexed by ID, with an fd index for the event loop,
+// a name index for the `name` builtin and a min-heap of free IDs so a new
+// login always gets the lowest available ID.
+class UserDirectory {
+    vector<UserInfo> slots;                // [1, capacity], slot 0 unused
+    vector<int> fdToId;                    // socket fd -> ID, 0 if none
+    unordered_map<string, int> nameCount;  // name -> number of online users
+    priority_queue<int, vector<int>, greater<int>> freeIds;
+    set<int> onlineIds;                    // ordered by ID for `who`
+
+    void resetSlot(UserInfo &user) {
+        user.isLogin = false;
+        user.id = 0;
+        user.name = "(no name)";
+        user.ipPort = "";
+        user.fd = -1;
+        user.env.clear();
+        user.env.set("PATH", "bin:."); // initial PATH is bin/ and ./
+        user.cmdCount = 0;
+        user.pipeManager = PipeManager();
+        user.output.clear();
+        user.attached = false;
+        user.shard = nullptr;
+        user.inputBuffer.clear();
+        user.pendingLines.clear();
+        user.deficit = 0;
+        user.scheduled = false;
+        user.closing = false;
+        user.sched.reset();
+    }
+
+  public:
+    // Guards login state, names and user pipes. Everything else in a slot
+    // belongs to the shard that owns the user.
+    mutex lock;
+
+    explicit UserDirectory(int capacity) : slots(capacity + 1) {
+        for (int id = 1; id <= capacity; id++) {
+            resetSlot(slots[id]);
+            slots[id].idleTimer.owner = &slots[id];
+            slots[id].loginTimer.owner = &slots[id];
+            freeIds.push(id);
+        }
+    }
+
+    int capacity() const { return slots.size() - 1; }
+
+    bool isFull() const { return freeIds.empty(); }
+
+    // ID of online users in ascending order
+    const set<int> &online() const { return onlineIds; }
+
+    UserInfo *byId(int id) {
+        if (id < 1 || id > capacity() || !slots[id].isLogin) {
+            return nullptr;
+        }
+        return &slots[id];
+    }
+
+    UserInfo *byFd(int fd) {
+        if (fd < 0 || fd >= (int)fdToId.size() || fdToId[fd] == 0) {
+            return nullptr;
+        }
+        return &slots[fdToId[fd]];
+    }
+
+    // Take the lowest free ID, nullptr when every slot is in use
+    UserInfo *login(int fd, const string &ipPort) {
+        if (freeIds.empty()) {
+            return nullptr;
+        }
+        int id = freeIds.top();
+        freeIds.pop();
+        UserInfo &user = slots[id];
+        user.isLogin = true;
+        user.id = id;
+        user.serial++;
+        user.ipPort = ipPort;
+        user.fd = fd;
+        if (fd >= (int)fdToId.size()) {
+            fdToId.resize(fd + 1, 0);
+        }
+        fdToId[fd] = id;
+        nameCount[user.name]++;
+        onlineIds.insert(id);
+        return &user;
+    }
+
+    void logout(UserInfo *user) {
+        if (--nameCount[user->name] == 0) {
+            nameCount.erase(user->name);
+        }
+        fdToId[user->fd] = 0;
+        onlineIds.erase(user->id);
+        freeIds.push(user->id);
+        resetSlot(*user);
+    }
+
+    bool nameExists(const string &name) const {
+        return nameCount.count(name) > 0;
+    }
+
+    void rename(UserInfo *user, const string &name) {
+        if (--nameCount[user->name] == 0) {
+            nameCount.erase(user->name);
+        }
+        user->name = name;
+        nameCount[name]++;
+    }
+};
+
+// One reactor thread. Users are sharded by ID and a shard owns the sessions
+// of its users: their sockets, output queues, pipes and environment. Other
+// threads reach those users only through the shard's mailbox, a lock-free
+// MPSC queue with an eventfd doorbell.
+class Shard {
+  public:
+    struct Mail {
+        enum Kind { ATTACH, DELIVER, BROADCAST, WAKE };
+        atomic<Mail *> next{nullptr};
+        Kind kind = DELIVER;
+        UserInfo *user = nullptr; // target of ATTACH and DELIVER
+        unsigned serial = 0;      // login serial of the target when sent
+        SharedBuffer buf;
+    };
+
+    static inline vector<Shard *> all;
+    static inline thread_local Shard *current = nullptr;
+    // --model session: every session gets a shard and a thread of its own,
+    // the shards in all[] only accept
+    static inline bool perSession = false;
+    static inline SessionTimeouts timeouts;
+
+    // user_data of the io_uring backend: the operation in the top byte, the
+    // login serial of a recv below it and a pointer or fd in the low 48 bits
+    enum RingOp { RING_RECV = 1, RING_ACCEPT, RING_DOORBELL, RING_CHILDREN,
+                  RING_SEND, RING_CANCEL };
+
+    static uint64_t ringTag(RingOp op, uint64_t low, unsigned serial = 0) {
+        return (uint64_t)op << 56 | (uint64_t)(serial & 0xff) << 48 |
+               (low & 0xffffffffffffULL);
+    }
+    static RingOp ringOp(uint64_t tag) { return RingOp(tag >> 56); }
+    static unsigned ringSerial(uint64_t tag) { return (tag >> 48) & 0xff; }
+    static uint64_t ringLow(uint64_t tag) { return tag & 0xffffffffffffULL; }
+
+    static uint64_t recvTag(const UserInfo *user) {
+        return ringTag(RING_RECV, (uintptr_t)user, user->serial);
+    }
+
+    int index;
+    int epfd;       // sessions of this shard, plus the doorbell
+    int doorbell;   // eventfd, readable when mail is waiting
+    int childEpfd;  // pidfds of running children, nested in epfd
+    TimerWheel timers; // idle and login limits of this shard's sessions
+    IoUring *ring = nullptr; // io_uring backend, epoll when nullptr
+
+    explicit Shard(int index)
+        : index(index), timers(TIMER_TICK_MS, monotonicNs() / 1000000),
+          head(&stub), tail(&stub) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev = {.events = EPOLLIN, .data = {.ptr = this}};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, doorbell, &ev);
+        childEpfd = epoll_create1(EPOLL_CLOEXEC);
+        ev.data.ptr = &childEpfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, childEpfd, &ev);
+    }
+
+    // Only once nobody can post here any more, see closeSession()
+    ~Shard() {
+        while (Mail *mail = pop()) {
+            delete mail;
+        }
+        for (ChildWatch *watch : watches) {
+            close(watch->pidfd);
+            delete watch;
+        }
+        delete ring;
+        close(childEpfd);
+        close(doorbell);
+        close(epfd);
+    }
+
+    // A shard for a session that is logging in, under the directory lock.
+    // It receives the broadcasts from here on.
+    static Shard *openSession(UserInfo *user) {
+        Shard *shard = new Shard(-1);
+        user->shard = shard;
+        lock_guard<mutex> guard(broadcastLock);
+        sessionShards.push_back(shard);
+        return shard;
+    }
+
+    // The session has logged out: other threads reach a shard only through
+    // a logged in user or a broadcast, so it can go once it's unlisted
+    static void closeSession(Shard *shard) {
+        {
+            lock_guard<mutex> guard(broadcastLock);
+            sessionShards.erase(
+                find(sessionShards.begin(), sessionShards.end(), shard));
+        }
+        delete shard;
+    }
+
+    // Count a child against its user's stage quota until it exits
+    void watchChild(UserInfo *user, pid_t pid) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd < 0) {
+            return; // already exited and reaped
+        }
+        ChildWatch *watch = new ChildWatch{user, user->serial, pidfd};
+        watches.push_back(watch);
+        user->sched.liveStages++;
+        epoll_event ev = {.events = EPOLLIN, .data = {.ptr = watch}};
+        epoll_ctl(childEpfd, EPOLL_CTL_ADD, pidfd, &ev);
+    }
+
+    void reapChildren() {
+        epoll_event events[64];
+        int n = epoll_wait(childEpfd, events, 64, 0);
+        serverStats->ioSyscalls++;
+        for (int i = 0; i < n; i++) {
+            ChildWatch *watch = (ChildWatch *)events[i].data.ptr;
+            if (watch->user->attached &&
+                watch->user->serial == watch->serial) {
+                watch->user->sched.liveStages--;
+            }
+            epoll_ctl(childEpfd, EPOLL_CTL_DEL, watch->pidfd, nullptr);
+            close(watch->pidfd);
+            watches.erase(find(watches.begin(), watches.end(), watch));
+            delete watch;
+        }
+    }
+
+    bool idle() const { return sessions.empty(); }
+
+    static Shard *of(const UserInfo *user) {
+        if (user->shard != nullptr) {
+            return user->shard;
+        }
+        return all[(user->id - 1) % all.size()];
+    }
+
+    // Start polling a freshly logged in user, greeting goes out first
+    void attach(UserInfo *user, SharedBuffer greeting) {
+        if (this == current) {
+            if (attachLocal(user, user->serial)) {
+                push(user, std::move(greeting));
+            }
+            return;
+        }
+        Mail *mail = new Mail;
+        mail->kind = Mail::ATTACH;
+        mail->user = user;
+        mail->serial = user->serial;
+        mail->buf = std::move(greeting);
+        post(mail);
+    }
+
+    void detach(UserInfo *user) {
+        timers.cancel(&user->idleTimer);
+        timers.cancel(&user->loginTimer);
+        if (!user->closing) {
+            unwatch(user);
+        }
+        sessions.erase(find(sessions.begin(), sessions.end(), user));
+        user->attached = false;
+        user->output.clear();
+    }
+
+    // Stop reading a session's socket
+    void unwatch(UserInfo *user) {
+        if (ring != nullptr) {
+            ring->prepCancel(recvTag(user), ringTag(RING_CANCEL, 0));
+        } else {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, user->fd, nullptr);
+        }
+    }
+
+    // (Re)start the multishot recv of a session
+    void watchRing(UserInfo *user) {
+        ring->prepRecvMultishot(user->fd, recvTag(user));
+    }
+
+    bool hasDeferred() const { return !deferred.empty(); }
+
+    // Next completion of the ring, including those set aside by flushRing()
+    bool nextCompletion(io_uring_cqe &cqe) {
+        if (!deferred.empty()) {
+            cqe = deferred.front();
+            deferred.pop_front();
+            return true;
+        }
+        return ring->popCompletion(cqe);
+    }
+
+    // Input arrived, restart the idle countdown
+    void touch(UserInfo *user) {
+        if (timeouts.idleMs) {
+            timers.schedule(&user->idleTimer,
+                            monotonicNs() / 1000000 + timeouts.idleMs);
+        }
+    }
+
+    // serial is the target's login serial, read under the directory lock
+    void deliver(UserInfo *user, unsigned serial, SharedBuffer buf) {
+        if (this == current) {
+            if (user->attached) {
+                push(user, std::move(buf));
+            }
+            return;
+        }
+        Mail *mail = new Mail;
+        mail->kind = Mail::DELIVER;
+        mail->user = user;
+        mail->serial = serial;
+        mail->buf = std::move(buf);
+        post(mail);
+    }
+
+    // Make the loop look at its scheduler again, for lines that were held
+    // back on another shard's account
+    void wake() {
+        if (this != current) {
+            Mail *mail = new Mail;
+            mail->kind = Mail::WAKE;
+            post(mail);
+        }
+    }
+
+    // Every shard receives broadcasts in the same order, so all users see
+    // the same sequence of messages as with a single reactor.
+    static void broadcast(SharedBuffer buf) {
+        if (all.size() == 1 && !perSession) {
+            all[0]->fanOut(buf);
+            return;
+        }
+        {
+            lock_guard<mutex> guard(broadcastLock);
+            for (Shard *shard : all) {
+                Mail *mail = new Mail;
+                mail->kind = Mail::BROADCAST;
+                mail->buf = buf;
+                shard->post(mail);
+            }
+            for (Shard *shard : sessionShards) {
+                Mail *mail = new Mail;
+                mail->kind = Mail::BROADCAST;
+                mail->buf = buf;
+                shard->post(mail);
+            }
+        }
+        // keep our own users' view in order with what we queue next
+        if (current != nullptr) {
+            current->drain();
+        }
+    }
+
+    // Handle all mail that has arrived so far
+    void drain() {
+        uint64_t count;
+        read(doorbell, &count, sizeof(count));
+        serverStats->ioSyscalls++;
+        // mail posted from here on rings again, earlier mail is popped below
+        rung.exchange(false, memory_order_acq_rel);
+        while (Mail *mail = pop()) {
+            if (mail->kind == Mail::BROADCAST) {
+                fanOut(mail->buf);
+            } else if (mail->kind == Mail::ATTACH) {
+                if (attachLocal(mail->user, mail->serial)) {
+                    push(mail->user, mail->buf);
+                }
+            } else if (mail->kind == Mail::WAKE) {
+                // nothing to deliver, the loop runs the scheduler next
+            } else if (mail->user->attached &&
+                       mail->user->serial == mail->serial) {
+                push(mail->user, mail->buf);
+            }
+            delete mail;
+        }
+    }
+
+    // Flush every queue touched since the last flush, return writev count
+    int flush() {
+        if (ring != nullptr) {
+            return flushRing();
+        }
+        int calls = 0;
+        for (UserInfo *user : dirtyUsers) {
+            user->output.scheduled = false;
+            if (user->attached) {
+                calls += user->output.flush(user->fd);
+            } else {
+                user->output.clear();
+            }
+        }
+        dirtyUsers.clear();
+        serverStats->ioSyscalls += calls;
+        return calls;
+    }
+
+  private:
+    struct ChildWatch {
+        UserInfo *user;
+        unsigned serial;
+        int pidfd;
+    };
+
+    static inline mutex broadcastLock; // one total order of broadcasts
+    static inline vector<Shard *> sessionShards; // under broadcastLock
+
+    atomic<Mail *> head; // producers swap themselves in here
+    // The doorbell was rung since the last drain, later producers skip the
+    // write: one wakeup however many broadcasts queue up meanwhile
+    atomic<bool> rung{false};
+    Mail *tail;          // consumer side
+    Mail stub;
+    vector<UserInfo *> sessions;
+    vector<UserInfo *> dirtyUsers;
+    vector<ChildWatch *> watches; // children still running
+    deque<io_uring_cqe> deferred; // completions read while flushRing waited
+
+    // One submission for all dirty queues: each user's buffers go out as a
+    // chain of linked sendmsg requests, so they reach the socket in order
+    // and a failed send cancels the rest of that chain. Waits for every
+    // send, since a child forked next writes to the same socket.
+    int flushRing() {
+        struct Send {
+            vector<SharedBuffer> bufs; // keeps the data alive until sent
+            vector<iovec> iov;
+            msghdr msg = {};
+        };
+        deque<Send> sends;
+        for (UserInfo *user : dirtyUsers) {
+            user->output.scheduled = false;
+            if (!user->attached) {
+                user->output.clear();
+                continue;
+            }
+            vector<SharedBuffer> bufs;
+            size_t skip;
+            user->output.takeAll(bufs, skip);
+            for (size_t i = 0; i < bufs.size(); i += OutputQueue::MAX_IOV) {
+                Send &send = sends.emplace_back();
+                size_t end = min(bufs.size(), i + OutputQueue::MAX_IOV);
+                for (size_t j = i; j < end; j++) {
+                    size_t off = j == 0 ? skip : 0;
+                    send.iov.push_back({(void *)(bufs[j]->data() + off),
+                                        bufs[j]->size() - off});
+                    send.bufs.push_back(std::move(bufs[j]));
+                }
+                send.msg.msg_iov = send.iov.data();
+                send.msg.msg_iovlen = send.iov.size();
+                ring->prepSendmsg(user->fd, &send.msg,
+                                  MSG_NOSIGNAL | MSG_WAITALL,
+                                  ringTag(RING_SEND, 0),
+                                  end < bufs.size());
+            }
+        }
+        dirtyUsers.clear();
+        size_t outstanding = sends.size();
+        while (outstanding > 0) {
+            int n = ring->submitAndWait(1, -1);
+            if (n < 0 && n != -EINTR) {
+                cerr << "io_uring_enter: " << strerror(-n) << endl;
+                break;
+            }
+            io_uring_cqe cqe;
+            while (outstanding > 0 && ring->popCompletion(cqe)) {
+                if (ringOp(cqe.user_data) == RING_SEND) {
+                    outstanding--; // errors drop the output, as in flush()
+                } else {
+                    deferred.push_back(cqe);
+                }
+            }
+        }
+        return sends.size();
+    }
+
+    bool attachLocal(UserInfo *user, unsigned serial) {
+        // the slot may have been reused by a later login already
+        if (user->serial != serial) {
+            return false;
+        }
+        user->attached = true;
+        sessions.push_back(user);
+        if (ring != nullptr) {
+            watchRing(user);
+        } else {
+            epoll_event ev = {.events = EPOLLIN, .data = {.ptr = user}};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, user->fd, &ev);
+        }
+        touch(user);
+        if (timeouts.loginMs) {
+            timers.schedule(&user->loginTimer,
+                            monotonicNs() / 1000000 + timeouts.loginMs);
+        }
+        return true;
+    }
+
+    void push(UserInfo *user, SharedBuffer buf) {
+        user->output.push(std::move(buf));
+        if (!user->output.scheduled) {
+            user->output.scheduled = true;
+            dirtyUsers.push_back(user);
+        }
+    }
+
+    void fanOut(const SharedBuffer &buf) {
+        for (UserInfo *user : sessions) {
+            push(user, buf);
+        }
+    }
+
+    void post(Mail *mail) {
+        mail->next.store(nullptr, memory_order_relaxed);
+        Mail *prev = head.exchange(mail, memory_order_acq_rel);
+        prev->next.store(mail, memory_order_release);
+        if (!rung.exchange(true, memory_order_acq_rel)) {
+            uint64_t one = 1;
+            write(doorbell, &one, sizeof(one));
+        }
+    }
+
+    // Vyukov intrusive MPSC pop, nullptr when empty or a push is midway
+    Mail *pop() {
+        Mail *first = tail;
+        Mail *next = first->next.load(memory_order_acquire);
+        if (first == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            tail = next;
+            first = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        stub.next.store(nullptr, memory_order_relaxed);
+        Mail *prev = head.exchange(&stub, memory_order_acq_rel);
+        prev->next.store(&stub, memory_order_release);
+        next = first->next.load(memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+};
+
+// `stats` output and the SIGUSR1 dump: server wide numbers, then the bytes
+// each online user sent and received. The /proc scan runs before the
+// directory lock is taken, only the per-user rows are made under it.
+inline string statsReport(UserDirectory &userList) {
+    string msg = serverStats->report();
+    lock_guard<mutex> guard(userList.lock);
+    msg += "<ID>\t<nickname>\t<bytes in>\t<bytes out>\n";
+    for (int id : userList.online()) {
+        UserInfo *user = userList.byId(id);
+        uint64_t in = 0, out = 0;
+        socketTraffic(user->fd, in, out);
+        msg += to_string(id) + "\t" + user->name + "\t" + to_string(in) +
+               "\t" + to_string(out) + "\n";
+    }
+    return msg;
+}
+
+// Child process limits, fields left at 0 are not applied
+struct ResourceLimits {
+    rlim_t cpuSeconds = 0;
+    rlim_t addressSpace = 0; // bytes
+    rlim_t processes = 0;
 };
 
 // Utility class, instance independent
@@ -76,41 +958,98 @@ class ProcessExecutor {
         int error_fd = STDERR_FILENO;
         bool userPipeFromErr = false;
         bool userPipeToErr = false;
+        int bulkTo = 0;     // output_fd is a bulk pipe to this user
+        off_t bulkHeld = 0; // what the sender has in other bulk pipes
     };
+    // setrlimit applied to every child, 0 means unlimited
+    static inline ResourceLimits limits;
+
     // static method bind on class
     static void run(const ProcessConfig &config, UserInfo *user,
-                    vector<UserInfo> &userList) {
+                    UserDirectory &userList) {
         if (handleBuiltins(config, user, userList)) {
             return;
         }
 
-        pid_t pid = createChildProcess();
-        if (pid != 0) {
+        // The child is vforked: it borrows our memory until it execs, so
+        // everything it needs is prepared here and it only makes syscalls.
+        // fork() would copy the page tables of every thread's stack, which
+        // costs milliseconds once there is a thread per session.
+        auto argv = prepareCommandArguments(config);
+        auto env = user->env.envp();
+        const string *path = user->env.get("PATH");
+        const vector<string> files =
+            candidateFiles(argv[0], path ? *path : "");
+        string unknown = "Unknown command: [" + config.arguments[0] + "].\n";
+
+        // child writes straight to the socket, send queued messages first
+        flushOutput();
+        // no handler of ours may run in the child, see resetSignals()
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pid_t pid = vfork();
+        if (pid == -1) {
+            // No wait() for a free slot: SIGCHLD is ignored, so it would block
+            // this thread until every session's children are gone
+            string msg = "Error: failed to start [" + config.arguments[0] +
+                         "]: " + strerror(errno) + "\n";
+            pthread_sigmask(SIG_SETMASK, &old, nullptr);
+            freeCommandArguments(argv);
             cleanupParentResources(config);
-            waitForChildIfNeeded(pid, config);
+            sendMessage(user, msg);
             return;
         }
+        if (pid == 0) {
+            resetSignals();
+            sigprocmask(SIG_SETMASK, &old, nullptr);
+            applyResourceLimits();
+            if (config.bulkTo != 0) {
+                BulkPipe::limitWriter(config.bulkHeld);
+            }
+            setupChildProcessIO(config);
+            // In fact, child and parent choose one close the originally fd
+            // before dup2 is fine, but close both side in case
+            removeNonNecessaryPipes(config);
+            executeExternalCommand(argv, env->envp, files, unknown);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
 
-        setupChildProcessIO(config);
-        // In fact, child and parent choose one close the originally fd before
-        // dup2 is fine, but close both side in case
-        removeNonNecessaryPipes(config);
-        executeExternalCommand(config);
+        serverStats->forks++;
+        freeCommandArguments(argv);
+        Shard::current->watchChild(user, pid);
+        cleanupParentResources(config);
+        waitForChildIfNeeded(pid, config);
     }
 
-    static void broadcastMessage(const string &msg,
-                                 vector<UserInfo> &userList) {
-        for (int idx = 1; idx <= MAXUSER; idx++) {
-            if (userList[idx].isLogin) {
-                write(userList[idx].fd, msg.c_str(), msg.size());
-            }
+    // A command that won't run: close what run() would have closed
+    static void release(const ProcessConfig &config) {
+        cleanupParentResources(config);
+    }
+
+    // Queue msg for one user, through its shard's mailbox if need be
+    static void sendMessage(UserInfo *user, SharedBuffer msg) {
+        Shard::of(user)->deliver(user, user->serial, std::move(msg));
+    }
+
+    static void sendMessage(UserInfo *user, const string &msg) {
+        sendMessage(user, makeBuffer(msg));
+    }
+
+    // Encode once, attach the same buffer to every online user's queue
+    static void broadcastMessage(const string &msg) {
+        if (!msg.empty()) {
+            Shard::broadcast(makeBuffer(msg));
         }
     }
 
+    // Flush the queues of this thread's shard, return writev count
+    static int flushOutput() { return Shard::current->flush(); }
+
   private:
     // since run call these function, need static
     static bool handleBuiltins(const ProcessConfig &config, UserInfo *user,
-                               vector<UserInfo> &userList) {
+                               UserDirectory &userList) {
         const string &cmd = config.arguments[0];
 
         if (cmd == "exit") {
@@ -118,44 +1057,48 @@ class ProcessExecutor {
         }
 
         if (cmd == "setenv") {
-            user->env[config.arguments[1].c_str()] =
-                config.arguments[2].c_str();
-            setenv(config.arguments[1].c_str(), config.arguments[2].c_str(), 1);
+            user->env.set(config.arguments[1], config.arguments[2]);
             return true;
         }
 
         if (cmd == "printenv") {
-            const char *env = getenv(config.arguments[1].c_str());
-            if (env != NULL) {
-                string msg = env + string("\n");
-                write(user->fd, msg.c_str(), msg.size());
+            const string *env = user->env.get(config.arguments[1]);
+            if (env != nullptr) {
+                sendMessage(user, *env + "\n");
             }
             return true;
         }
 
+        if (cmd == "stats") {
+            sendMessage(user, statsReport(userList));
+            return true;
+        }
+
         if (cmd == "who") {
+            lock_guard<mutex> guard(userList.lock);
             string msg = "<ID>\t<nickname>\t<IP:port>\t<indicate me>\n";
-            for (int idx = 1; idx <= MAXUSER; idx++) {
-                if (userList[idx].isLogin) {
-                    msg += to_string(userList[idx].id) + "\t" +
-                           userList[idx].name + "\t" + userList[idx].ipPort;
-                    if (idx == user->id) {
-                        msg += "\t<-me";
-                    }
-                    msg += "\n";
+            for (int id : userList.online()) {
+                UserInfo *other = userList.byId(id);
+                msg += to_string(other->id) + "\t" + other->name + "\t" +
+                       other->ipPort;
+                if (id == user->id) {
+                    msg += "\t<-me";
                 }
+                msg += "\n";
             }
-            write(user->fd, msg.c_str(), msg.size());
+            sendMessage(user, msg);
             return true;
         }
 
         if (cmd == "tell") {
+            lock_guard<mutex> guard(userList.lock);
             int targetId = stoi(config.arguments[1]);
+            UserInfo *target = userList.byId(targetId);
             string msg = "";
-            if (!userList[targetId].isLogin) {
+            if (target == nullptr) {
                 msg += "*** Error: user #" + to_string(targetId) +
                        " does not exist yet. ***\n";
-                write(user->fd, msg.c_str(), msg.size());
+                sendMessage(user, msg);
             } else { // send message to target user
                 msg += "*** " + user->name + " told you ***: ";
                 for (int i = 2; i < config.arguments.size(); i++) {
@@ -165,7 +1108,7 @@ class ProcessExecutor {
                     }
                 }
                 msg += "\n";
-                write(userList[targetId].fd, msg.c_str(), msg.size());
+                sendMessage(target, msg);
             }
             return true;
         }
@@ -179,39 +1122,51 @@ class ProcessExecutor {
                 }
             }
             msg += "\n";
-            broadcastMessage(msg, userList);
+            broadcastMessage(msg);
             return true;
         }
 
         if (cmd == "name") {
-            bool isNameExist = false;
-            for (int idx = 1; idx <= MAXUSER; idx++) {
-                if (userList[idx].isLogin &&
-                    userList[idx].name == config.arguments[1]) {
-                    cout << "*** User '" << config.arguments[1]
-                         << "' already exists. ***" << endl;
-                    isNameExist = true;
-                }
-            }
-            if (!isNameExist) {
-                user->name = config.arguments[1];
+            lock_guard<mutex> guard(userList.lock);
+            if (userList.nameExists(config.arguments[1])) {
+                sendMessage(user, "*** User '" + config.arguments[1] +
+                                      "' already exists. ***\n");
+            } else {
+                userList.rename(user, config.arguments[1]);
                 string msg = "*** User from " + user->ipPort + " is named '" +
                              user->name + "'. ***\n";
-                broadcastMessage(msg, userList);
+                broadcastMessage(msg);
             }
             return true;
         }
         return false;
     }
 
-    static pid_t createChildProcess() {
-        pid_t pid;
-        while ((pid = fork()) == -1) {
-            if (errno == EAGAIN) {
-                wait(nullptr);
+    // In the vfork child: the handlers are the server's and would run on
+    // its memory, put them back to the default before signals are let in.
+    // exec would do the same, only later.
+    static void resetSignals() {
+        struct sigaction action;
+        for (int sig = 1; sig < NSIG; sig++) {
+            if (sigaction(sig, nullptr, &action) == 0 &&
+                action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN) {
+                signal(sig, SIG_DFL);
+            }
+        }
+    }
+
+    static void applyResourceLimits() {
+        const pair<int, rlim_t> settings[] = {
+            {RLIMIT_CPU, limits.cpuSeconds},
+            {RLIMIT_AS, limits.addressSpace},
+            {RLIMIT_NPROC, limits.processes},
+        };
+        for (const auto &[resource, value] : settings) {
+            if (value != 0) {
+                rlimit limit = {value, value};
+                setrlimit(resource, &limit);
             }
         }
-        return pid;
     }
 
     static void cleanupParentResources(const ProcessConfig &config) {
@@ -223,7 +1178,9 @@ class ProcessExecutor {
         // get the fd file type
         fstat(config.output_fd, &fd_stat);
         // close file if fd_out isn't STDOUT_FILENO and is a regular file.
-        if (config.output_fd != STDOUT_FILENO && S_ISREG(fd_stat.st_mode)) {
+        // A bulk pipe is sealed first, by the parser.
+        if (config.output_fd != STDOUT_FILENO && S_ISREG(fd_stat.st_mode) &&
+            config.bulkTo == 0) {
             close(config.output_fd);
         }
     }
@@ -257,17 +1214,49 @@ class ProcessExecutor {
         if (config.pipe[0] != STDIN_FILENO) {
             close(config.pipe[0]);
         }
-        if (config.pipe[1] != STDOUT_FILENO) {
+        if (config.pipe[1] != STDOUT_FILENO && config.pipe[1] >= 0) {
             close(config.pipe[1]);
         }
     }
 
-    static void executeExternalCommand(const ProcessConfig &config) {
-        auto argv = prepareCommandArguments(config);
-        if (execvp(argv[0], argv.data()) == -1 && errno == ENOENT) {
-            cerr << "Unknown command: [" << argv[0] << "].\n";
-            exit(0);
+    // Where execvp would look for name with this PATH, in order. A name
+    // with a slash is the only candidate.
+    static vector<string> candidateFiles(const char *name,
+                                         const string &path) {
+        if (strchr(name, '/') != nullptr) {
+            return {name};
+        }
+        vector<string> files;
+        size_t begin = 0;
+        while (begin <= path.size()) {
+            size_t end = path.find(':', begin);
+            if (end == string::npos) {
+                end = path.size();
+            }
+            string dir = path.substr(begin, end - begin);
+            files.push_back((dir.empty() ? "." : dir) + "/" + name);
+            begin = end + 1;
         }
+        return files;
+    }
+
+    // execvp with the user's PATH and envp instead of the server environ,
+    // nothing allocated: we are a vfork child. Like execvp, a file found
+    // but not executable wins over the rest of the search not finding it.
+    static void executeExternalCommand(vector<char *> &argv,
+                                       const vector<char *> &envp,
+                                       const vector<string> &files,
+                                       const string &unknown) {
+        char *const *env = const_cast<char *const *>(envp.data());
+        bool denied = false;
+        for (const string &file : files) {
+            execve(file.c_str(), argv.data(), env);
+            denied = denied || errno == EACCES;
+        }
+        if (!denied && (errno == ENOENT || errno == ENOTDIR)) {
+            write(STDERR_FILENO, unknown.c_str(), unknown.size());
+        }
+        _exit(0);
     }
 
     static vector<char *> prepareCommandArguments(const ProcessConfig &config) {
@@ -278,6 +1267,12 @@ class ProcessExecutor {
         args.push_back(nullptr);
         return args;
     }
+
+    static void freeCommandArguments(vector<char *> &args) {
+        for (char *arg : args) {
+            free(arg);
+        }
+    }
 };
 
 class CommandParser {
@@ -285,16 +1280,17 @@ class CommandParser {
     vector<string> current_args;
     PipeManager &pipe_manager;
     UserInfo *userInfo;
-    vector<UserInfo> &userList;
-    unordered_map<pair<int, int>, pair<int, int>, pair_hash> &userPipe;
+    UserDirectory &userList;
+    UserPipeRegistry &userPipe;
     string lineCommand;
     string pipeOutMsg;
+    bool pipeFailed = false; // the rest of the line is dropped
 
   public:
     CommandParser(
         const string &line, PipeManager &pm, UserInfo *userInfo,
-        vector<UserInfo> &userList,
-        unordered_map<pair<int, int>, pair<int, int>, pair_hash> &userPipe)
+        UserDirectory &userList,
+        UserPipeRegistry &userPipe)
         : input_stream(line), pipe_manager(pm), userInfo(userInfo),
           userList(userList), userPipe(userPipe), lineCommand(line) {}
 
@@ -312,6 +1308,9 @@ class CommandParser {
             }
             if (isOperator(token[0])) {
                 executeCurrentCommand(token);
+                if (pipeFailed) {
+                    return;
+                }
             } else {
                 current_args.push_back(token);
             }
@@ -327,16 +1326,33 @@ class CommandParser {
         return c == '|' || c == '!' || c == '>' || c == '<';
     }
 
-    void executeCurrentCommand(string &operator_token) {
+    // Output goes to the user's socket unless an operator redirects it
+    ProcessExecutor::ProcessConfig newConfig() {
         ProcessExecutor::ProcessConfig config;
+        config.output_fd = userInfo->fd;
+        config.error_fd = userInfo->fd;
+        return config;
+    }
+
+    void executeCurrentCommand(string &operator_token) {
+        ProcessExecutor::ProcessConfig config = newConfig();
         config.arguments = current_args;
         current_args.clear();
         setupInputPipe(config);
         // because testcase cat <2 >3, cat <3 >2. So require 1-token lookahead
         // here to set up pipe before run.
         handleOperator(operator_token, config);
+        if (pipeFailed) {
+            // the line still counts once for the numbered pipes
+            ProcessExecutor::release(config);
+            pipe_manager.shiftPipeNumbers();
+            return;
+        }
 
         ProcessExecutor::run(config, userInfo, userList);
+        if (config.bulkTo != 0) { // the writer is done
+            sealBulkPipe(config);
+        }
         // Here is mid of command, so only shift when "|n" or "!n". ">" doesn't
         // enter here
         if (operator_token != "|") {
@@ -344,6 +1360,28 @@ class CommandParser {
         }
     }
 
+    // Hand the bulk pipe over to its receiver, or drop it and tell both
+    // users when the writer went over the limit. Either way the receiver's
+    // shard is woken: a line of its may be waiting for this pipe.
+    void sealBulkPipe(const ProcessExecutor::ProcessConfig &config) {
+        lock_guard<mutex> guard(userList.lock);
+        bool sealed = userPipe.seal(config.bulkTo, userInfo->id,
+                                    config.output_fd, config.bulkHeld);
+        close(config.output_fd);
+        UserInfo *recvUser = userList.byId(config.bulkTo);
+        if (sealed) {
+            if (recvUser != nullptr) {
+                Shard::of(recvUser)->wake();
+            }
+            return;
+        }
+        string msg = BulkPipe::overrunMessage(userInfo->id, config.bulkTo);
+        ProcessExecutor::sendMessage(userInfo, msg);
+        if (recvUser != nullptr && recvUser != userInfo) {
+            ProcessExecutor::sendMessage(recvUser, msg);
+        }
+    }
+
     void setupInputPipe(ProcessExecutor::ProcessConfig &config) {
         // still need assign pipe[1] for fd_in process close fd
         if (pipe_manager.hasPipe(0)) {
@@ -354,13 +1392,13 @@ class CommandParser {
         }
         // If following command have error, redirect output to null
         if (config.userPipeFromErr) {
-            config.pipe[0] = open("/dev/null", O_RDWR);
-            config.pipe[1] = open("/dev/null", O_RDWR);
+            config.pipe[0] = open("/dev/null", O_RDWR | O_CLOEXEC);
+            config.pipe[1] = open("/dev/null", O_RDWR | O_CLOEXEC);
         }
         if (config.userPipeToErr) {
-            config.output_fd = open("/dev/null", O_RDWR);
-            config.pipe[0] = open("/dev/null", O_RDWR);
-            config.pipe[1] = open("/dev/null", O_RDWR);
+            config.output_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+            config.pipe[0] = open("/dev/null", O_RDWR | O_CLOEXEC);
+            config.pipe[1] = open("/dev/null", O_RDWR | O_CLOEXEC);
         }
     }
 
@@ -380,6 +1418,9 @@ class CommandParser {
             }
         } else {
             handlePiping(op, config);
+            if (pipeFailed) {
+                return;
+            }
         }
         // pipe from user_pipe if possible
         // cat >3 <2. 1-token lookahead.
@@ -394,7 +1435,7 @@ class CommandParser {
             input_stream.seekg(position);
             op = opBackup;
         }
-        ProcessExecutor::broadcastMessage(pipeOutMsg, userList);
+        ProcessExecutor::broadcastMessage(pipeOutMsg);
     }
     void handleRedirection(ProcessExecutor::ProcessConfig &config) {
         string filename;
@@ -403,45 +1444,69 @@ class CommandParser {
                                 O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0664);
     }
 
+    // A memfd and a second fd to it. False with nothing left open when that
+    // fails, the directory lock is held so nothing waits for fds here.
+    static bool openBulkPipe(int pipe_fds[2]) {
+        if ((pipe_fds[1] = BulkPipe::create()) < 0) {
+            return false;
+        }
+        if ((pipe_fds[0] = fcntl(pipe_fds[1], F_DUPFD_CLOEXEC, 0)) < 0) {
+            close(pipe_fds[1]);
+            return false;
+        }
+        return true;
+    }
+
     void handleOutUserPipe(const string &op,
                            ProcessExecutor::ProcessConfig &config) {
         int sendUserId = userInfo->id;
         int recvUserId = stoi(op.substr(1));
+        lock_guard<mutex> guard(userList.lock);
+        UserInfo *recvUser = userList.byId(recvUserId);
         // recv user not exist
-        if (recvUserId < 0 || recvUserId > 30 ||
-            !userList[recvUserId].isLogin) {
+        if (recvUser == nullptr) {
             config.userPipeToErr = true;
             string msg = "*** Error: user #" + to_string(recvUserId) +
                          " does not exist yet. ***\n";
             setupInputPipe(config); // trigger userPipeToErr again
-            write(userInfo->fd, msg.c_str(), msg.size());
+            ProcessExecutor::sendMessage(userInfo, msg);
             return;
         }
-        auto it = userPipe.find(make_pair(recvUserId, sendUserId));
-        if (it != userPipe.end()) {
+        if (userPipe.contains(recvUserId, sendUserId)) {
             // found it
             config.userPipeToErr = true;
             string msg = "*** Error: the pipe #" + to_string(sendUserId) +
                          "->#" + to_string(recvUserId) +
                          " already exists. ***\n";
             setupInputPipe(config); // trigger userPipeToErr again
-            write(userInfo->fd, msg.c_str(), msg.size());
+            ProcessExecutor::sendMessage(userInfo, msg);
         } else {
             int pipe_fds[2];
-            while (pipe(pipe_fds) == -1) {
-                if (errno == EMFILE || errno == ENFILE) {
-                    wait(nullptr);
-                }
+            // the bulk pipe's registry copy is the receiver's, ours is
+            // sealed once the writer is done
+            bool bulk = BulkPipe::enabled();
+            if (bulk ? !openBulkPipe(pipe_fds)
+                     : pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                config.userPipeToErr = true;
+                setupInputPipe(config);
+                ProcessExecutor::sendMessage(
+                    userInfo, "Error: failed to create user pipe\n");
+                return;
+            }
+            if (bulk) {
+                userPipe.add(recvUserId, sendUserId,
+                             {pipe_fds[0], -1, 0, true});
+                config.bulkTo = recvUserId;
+                config.bulkHeld = userPipe.heldBy(sendUserId);
+            } else {
+                userPipe.add(recvUserId, sendUserId,
+                             {pipe_fds[0], pipe_fds[1]});
             }
-            userPipe[make_pair(recvUserId, sendUserId)] =
-                make_pair(pipe_fds[0], pipe_fds[1]);
-            fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
-            fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
             config.output_fd = pipe_fds[1];
             config.error_fd = pipe_fds[1];
             string msg = "*** " + userInfo->name + " (#" +
                          to_string(userInfo->id) + ") just piped '" +
-                         lineCommand + "' to " + userList[recvUserId].name +
+                         lineCommand + "' to " + recvUser->name +
                          " (#" + to_string(recvUserId) + ") ***\n";
             // save message for last output. Ex: cat >3 <2
             pipeOutMsg = msg;
@@ -451,33 +1516,30 @@ class CommandParser {
     void handleInUserPipe(const string &op,
                           ProcessExecutor::ProcessConfig &config) {
         int sendUserId = stoi(op.substr(1));
+        lock_guard<mutex> guard(userList.lock);
+        UserInfo *sendUser = userList.byId(sendUserId);
         // sender not exist
-        if (sendUserId < 0 || sendUserId > 30 ||
-            !userList[sendUserId].isLogin) { // the source user does not exist
+        if (sendUser == nullptr) { // the source user does not exist
             config.userPipeFromErr = true;
             string msg = "*** Error: user #" + to_string(sendUserId) +
                          " does not exist yet. ***\n";
             setupInputPipe(config); // trigger userPipeFromErr again
-            write(userInfo->fd, msg.c_str(), msg.size());
+            ProcessExecutor::sendMessage(userInfo, msg);
             return;
         }
-        auto it = userPipe.find(make_pair(userInfo->id, sendUserId));
-        if (it != userPipe.end()) {
+        UserPipeRegistry::Fds pipeFd;
+        // remove user pipe from registry after read pipe
+        if (userPipe.take(userInfo->id, sendUserId, pipeFd)) {
             // Found it: have pipe to read
-            pair pipeFd = it->second;
-            int inputFd = pipeFd.first;
-            int outFd = pipeFd.second;
-            config.pipe[0] = inputFd;
-            config.pipe[1] = outFd;
-            // remove userPipe map after read pipe
-            it = userPipe.erase(it);
-            string msg = "*** " + userList[userInfo->id].name + " (#" +
+            config.pipe[0] = pipeFd.readFd;
+            config.pipe[1] = pipeFd.writeFd;
+            string msg = "*** " + userInfo->name + " (#" +
                          to_string(userInfo->id) + ") just received from " +
-                         userList[sendUserId].name + " (#" +
+                         sendUser->name + " (#" +
                          to_string(sendUserId) + ") by '" + lineCommand +
                          "' ***\n";
             // directly broadcast, since "<" broadcast before ">"
-            ProcessExecutor::broadcastMessage(msg, userList);
+            ProcessExecutor::broadcastMessage(msg);
         } else {
             // Not found: pipe doesn't create
             config.userPipeFromErr = true;
@@ -485,7 +1547,7 @@ class CommandParser {
                          "->#" + to_string(userInfo->id) +
                          " does not exist yet. ***\n";
             setupInputPipe(config); // trigger userPipeFromErr again
-            write(userInfo->fd, msg.c_str(), msg.size());
+            ProcessExecutor::sendMessage(userInfo, msg);
         }
     }
 
@@ -493,8 +1555,13 @@ class CommandParser {
                       ProcessExecutor::ProcessConfig &config) {
         int pipe_id = op.size() > 1 ? stoi(op.substr(1)) : 0;
 
-        if (!pipe_manager.hasPipe(pipe_id)) {
-            pipe_manager.createPipe(pipe_id);
+        if (!pipe_manager.hasPipe(pipe_id) &&
+            !pipe_manager.createPipe(pipe_id)) {
+            pipeFailed = true;
+            ProcessExecutor::sendMessage(
+                userInfo, "Error: failed to create pipe: " +
+                              string(strerror(errno)) + "\n");
+            return;
         }
 
         int *pipe_fds = pipe_manager.active_pipes[pipe_id];
@@ -509,7 +1576,7 @@ class CommandParser {
 
     void executeRemainingCommand() {
         if (!current_args.empty()) {
-            ProcessExecutor::ProcessConfig config;
+            ProcessExecutor::ProcessConfig config = newConfig();
             config.arguments = current_args;
             setupInputPipe(config);
 
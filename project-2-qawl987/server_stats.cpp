@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <linux/tcp.h>
+#include <map>
+#include <netinet/in.h>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Server health counters. Everything is a relaxed atomic so reactor threads
+// and forked processes (np_multi_proc keeps this in shared memory) record
+// without locks; readers get a slightly blurred but consistent enough view.
+
+inline uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Log-linear histogram in the style of HdrHistogram: 16 linear sub-buckets
+// per power of two, so any uint64_t is kept within ~6% of its value.
+class StatsHistogram {
+    static const int SUB_BITS = 4;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> maxValue;
+
+    static int indexOf(uint64_t v) {
+        if (v < SUB_COUNT) {
+            return v;
+        }
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((v >> shift) & (SUB_COUNT - 1));
+    }
+
+    // Middle of the bucket
+    static uint64_t valueOf(int idx) {
+        if (idx < SUB_COUNT) {
+            return idx;
+        }
+        int shift = idx / SUB_COUNT - 1;
+        uint64_t low = (uint64_t)(SUB_COUNT + idx % SUB_COUNT) << shift;
+        return low + ((1ull << shift) >> 1);
+    }
+
+  public:
+    StatsHistogram() : total(0), maxValue(0) {
+        for (auto &c : counts) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t v) {
+        counts[indexOf(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = maxValue.load(std::memory_order_relaxed);
+        while (v > seen && !maxValue.compare_exchange_weak(
+                               seen, v, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(p * n) + 1;
+        uint64_t seen = 0;
+        for (int idx = 0; idx < BUCKETS; idx++) {
+            seen += counts[idx].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(valueOf(idx), max());
+            }
+        }
+        return max();
+    }
+};
+
+// Bytes the kernel moved over a TCP socket, child output included
+inline bool socketTraffic(int fd, uint64_t &in, uint64_t &out) {
+    tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return false;
+    }
+    in = info.tcpi_bytes_received;
+    out = info.tcpi_bytes_acked;
+    return true;
+}
+
+inline int countOpenFds(pid_t pid) {
+    std::string path = "/proc/" + std::to_string(pid) + "/fd";
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return -1;
+    }
+    int n = 0;
+    while (dirent *entry = readdir(dir)) {
+        n += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    return pid == getpid() ? n - 1 : n; // minus the directory stream itself
+}
+
+// Processes below root: commands, and for np_multi_proc the user processes
+inline int countDescendants(pid_t root) {
+    std::multimap<pid_t, pid_t> children; // ppid -> pid
+    DIR *dir = opendir("/proc");
+    if (dir == nullptr) {
+        return -1;
+    }
+    while (dirent *entry = readdir(dir)) {
+        pid_t pid = atoi(entry->d_name);
+        if (pid <= 0) {
+            continue;
+        }
+        std::string path = "/proc/" + std::string(entry->d_name) + "/stat";
+        FILE *f = fopen(path.c_str(), "r");
+        if (f == nullptr) {
+            continue;
+        }
+        char buf[512];
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[n] = '\0';
+        // the command name may hold spaces, ppid follows ") <state> "
+        char *comm = strrchr(buf, ')');
+        int ppid;
+        if (comm != nullptr && sscanf(comm + 1, " %*c %d", &ppid) == 1) {
+            children.insert({ppid, pid});
+        }
+    }
+    closedir(dir);
+
+    int total = 0;
+    std::vector<pid_t> todo = {root};
+    while (!todo.empty()) {
+        pid_t parent = todo.back();
+        todo.pop_back();
+        auto range = children.equal_range(parent);
+        for (auto it = range.first; it != range.second; ++it) {
+            total++;
+            todo.push_back(it->second);
+        }
+    }
+    return total;
+}
+
+struct ServerStats {
+    StatsHistogram loopNs;          // one event loop wakeup, start to flush
+    StatsHistogram eventsPerWakeup; // ready fds returned by one wait
+    StatsHistogram shellNs;         // running one input line
+    StatsHistogram internalMsgNs;   // np_multi_proc publishing a message
+    std::atomic<uint64_t> forks{0};
+    std::atomic<uint64_t> rejected{0}; // connections turned away at accept
+    // event loop syscalls of np_single_proc: waits, reads, sends, accepts
+    std::atomic<uint64_t> ioSyscalls{0};
+    // np_multi_proc readers that fell a whole broadcast ring behind
+    std::atomic<uint64_t> overruns{0};
+    // np_multi_proc user processes that died without `exit`: killed,
+    // crashed, or SIGPIPE after the client hung up
+    std::atomic<uint64_t> crashes{0};
+    uint64_t startNs = monotonicNs();
+    pid_t serverPid = getpid();
+
+    // Server wide part of the `stats` output and the SIGUSR1 dump
+    std::string report() const {
+        std::ostringstream ss;
+        double uptime = (monotonicNs() - startNs) / 1e9;
+        ss.setf(std::ios::fixed);
+        ss.precision(1);
+        ss << "uptime " << uptime << " s, forks " << forks.load() << " ("
+           << (uptime > 0 ? forks.load() / uptime : 0) << "/s), processes "
+           << countDescendants(serverPid) << ", open fds "
+           << countOpenFds(serverPid) << ", rejected " << rejected.load();
+        if (ioSyscalls.load() > 0) {
+            ss << ", io syscalls " << ioSyscalls.load();
+        }
+        if (overruns.load() > 0) {
+            ss << ", ring overruns " << overruns.load();
+        }
+        if (crashes.load() > 0) {
+            ss << ", died without exit " << crashes.load();
+        }
+        ss << "\n";
+        ss << "<metric>\t<count>\t<p50>\t<p99>\t<p999>\t<max>\n";
+        line(ss, "loop_us", loopNs, 1000);
+        line(ss, "events/wakeup", eventsPerWakeup, 1);
+        line(ss, "shell_us", shellNs, 1000);
+        if (internalMsgNs.count() > 0) {
+            line(ss, "publish_us", internalMsgNs, 1000);
+        }
+        return ss.str();
+    }
+
+  private:
+    static void line(std::ostringstream &ss, const char *name,
+                     const StatsHistogram &h, double unit) {
+        ss << name << "\t" << h.count() << "\t" << h.percentile(0.5) / unit
+           << "\t" << h.percentile(0.99) / unit << "\t"
+           << h.percentile(0.999) / unit << "\t" << h.max() / unit << "\n";
+    }
+};
+
+// Process local by default, np_multi_proc points it into shared memory
+inline ServerStats defaultStats;
+inline ServerStats *serverStats = &defaultStats;
@@ -0,0 +1,121 @@
+#include <atomic>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Opt-in recording of what clients type, for replaying real sessions
+// against any server model (project-4 np_replay).
+//
+// File layout: the 8 byte magic, then one record per event:
+//   CaptureRecord header (20 bytes, host byte order) + length payload bytes
+// OPEN carries the client's IP:port, LINE one input line without its line
+// ending, CLOSE nothing. Records are written with a single O_APPEND write so
+// threads and forked server processes can share the file.
+
+#define CAPTURE_MAGIC "NPCAP001"
+
+struct CaptureRecord {
+    uint64_t monoNs;  // CLOCK_MONOTONIC
+    uint32_t session; // unique per connection within one file
+    uint16_t userId;  // 0 when the server has no user IDs
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t length;
+} __attribute__((packed));
+
+class SessionCapture {
+  public:
+    enum RecordType : uint8_t { OPEN = 1, LINE = 2, CLOSE = 3 };
+
+    static bool open(const std::string &path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0644);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            write(fd, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+        }
+        return true;
+    }
+
+    static bool enabled() { return fd >= 0; }
+
+    static uint32_t newSession() { return ++sessions; }
+
+    static void record(RecordType type, uint32_t session, int userId,
+                       const std::string &payload = "") {
+        if (fd < 0) {
+            return;
+        }
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        CaptureRecord header = {};
+        header.monoNs = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        header.session = session;
+        header.userId = userId;
+        header.type = type;
+        header.length = payload.size();
+        std::string buf((const char *)&header, sizeof(header));
+        buf += payload;
+        write(fd, buf.data(), buf.size());
+    }
+
+    // Strip the line ending telnet sends
+    static void recordLine(uint32_t session, int userId, std::string line) {
+        line.erase(line.find_last_not_of("\r\n") + 1);
+        record(LINE, session, userId, line);
+    }
+
+  private:
+    static inline int fd = -1;
+    static inline std::atomic<uint32_t> sessions{0};
+};
+
+// Sequential reader used by the replay tool
+class CaptureReader {
+  public:
+    explicit CaptureReader(const std::string &path) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        char magic[8];
+        valid = fd >= 0 && readFully(magic, sizeof(magic)) &&
+                memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+    }
+    ~CaptureReader() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool ok() const { return valid; }
+
+    bool next(CaptureRecord &header, std::string &payload) {
+        if (!valid || !readFully(&header, sizeof(header))) {
+            return false;
+        }
+        payload.resize(header.length);
+        return header.length == 0 || readFully(&payload[0], header.length);
+    }
+
+  private:
+    int fd;
+    bool valid;
+
+    bool readFully(void *buf, size_t len) {
+        char *p = (char *)buf;
+        while (len > 0) {
+            ssize_t n = read(fd, p, len);
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+};
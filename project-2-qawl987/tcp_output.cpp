@@ -0,0 +1,48 @@
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <string>
+#include <sys/socket.h>
+
+// How client sockets batch the small writes of one command: its output,
+// messages from other users and the prompt.
+//   nagle    kernel default, a small write may wait for the previous ACK
+//   nodelay  TCP_NODELAY, every write leaves at once (default)
+//   cork     TCP_CORK while a line is handled, released once the prompt is
+//            written so everything goes out in as few segments as possible
+class TcpOutput {
+  public:
+    enum Mode { NAGLE, NODELAY, CORK };
+
+    static inline Mode mode = NODELAY;
+
+    static bool parse(const std::string &name) {
+        if (name == "nagle") {
+            mode = NAGLE;
+        } else if (name == "nodelay") {
+            mode = NODELAY;
+        } else if (name == "cork") {
+            mode = CORK;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Once per accepted connection. Corked sockets also get TCP_NODELAY so
+    // uncorking sends the tail right away.
+    static void setup(int fd) {
+        int on = mode != NAGLE;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    static void cork(int fd) { setCork(fd, 1); }
+
+    static void uncork(int fd) { setCork(fd, 0); }
+
+  private:
+    static void setCork(int fd, int on) {
+        if (mode == CORK) {
+            setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        }
+    }
+};
@@ -0,0 +1,197 @@
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Session time limits of the np servers, kept in a hierarchical timer wheel
+// (Varghese & Lauck, the layout of the classic Linux kernel timers): every
+// pending timer sits in an intrusive list, so schedule and cancel are O(1)
+// and advancing touches only the timers that are due, plus one cascade of a
+// higher level every 256 ticks.
+
+// Embedded in whatever owns the timer, owner is handed back on expiry
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // in ticks
+    void *owner = nullptr;
+
+    bool pending() const { return next != nullptr; }
+};
+
+class TimerWheel {
+    static const int ROOT_BITS = 8;
+    static const int ROOT_SIZE = 1 << ROOT_BITS;
+    static const int LEVEL_BITS = 6;
+    static const int LEVEL_SIZE = 1 << LEVEL_BITS;
+    static const int LEVELS = 3; // above the root: 2^26 ticks in total
+    static const uint64_t MAX_TICKS = 1ull << (ROOT_BITS + LEVELS * LEVEL_BITS);
+
+    uint64_t tickMs;
+    uint64_t current; // next tick to expire
+    size_t count = 0;
+    TimerNode root[ROOT_SIZE];
+    TimerNode levels[LEVELS][LEVEL_SIZE];
+
+    static void initList(TimerNode &head) { head.prev = head.next = &head; }
+
+    static void unlink(TimerNode *node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    static void append(TimerNode &head, TimerNode *node) {
+        node->prev = head.prev;
+        node->next = &head;
+        head.prev->next = node;
+        head.prev = node;
+    }
+
+    // Move a whole slot to an empty list head
+    static void splice(TimerNode &from, TimerNode &to) {
+        if (from.next == &from) {
+            initList(to);
+            return;
+        }
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        initList(from);
+    }
+
+    void place(TimerNode *node) {
+        uint64_t delta = node->expires > current ? node->expires - current : 0;
+        if (delta < ROOT_SIZE) {
+            uint64_t at = node->expires > current ? node->expires : current;
+            append(root[at & (ROOT_SIZE - 1)], node);
+            return;
+        }
+        for (int level = 0; level < LEVELS; level++) {
+            int shift = ROOT_BITS + level * LEVEL_BITS;
+            if (delta < 1ull << (shift + LEVEL_BITS) || level == LEVELS - 1) {
+                append(levels[level][(node->expires >> shift) &
+                                     (LEVEL_SIZE - 1)],
+                       node);
+                return;
+            }
+        }
+    }
+
+    // Re-place the timers of the level slot that the current tick enters
+    void cascade(int level) {
+        int shift = ROOT_BITS + level * LEVEL_BITS;
+        int idx = (current >> shift) & (LEVEL_SIZE - 1);
+        TimerNode list;
+        splice(levels[level][idx], list);
+        while (list.next != &list) {
+            TimerNode *node = list.next;
+            unlink(node);
+            place(node);
+        }
+        if (idx == 0 && level + 1 < LEVELS) {
+            cascade(level + 1);
+        }
+    }
+
+  public:
+    TimerWheel(uint64_t tickMs, uint64_t nowMs)
+        : tickMs(tickMs), current(nowMs / tickMs) {
+        for (TimerNode &head : root) {
+            initList(head);
+        }
+        for (auto &level : levels) {
+            for (TimerNode &head : level) {
+                initList(head);
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // (Re)arm node to fire at dueMs, rounded up to the next tick
+    void schedule(TimerNode *node, uint64_t dueMs) {
+        cancel(node);
+        uint64_t due = (dueMs + tickMs - 1) / tickMs;
+        if (due > current && due - current >= MAX_TICKS) {
+            due = current + MAX_TICKS - 1;
+        }
+        node->expires = due;
+        place(node);
+        count++;
+    }
+
+    void cancel(TimerNode *node) {
+        if (node->pending()) {
+            unlink(node);
+            count--;
+        }
+    }
+
+    // Fire everything due by nowMs. onExpire may schedule or cancel timers,
+    // including ones that are due in the same call.
+    template <class F> void advance(uint64_t nowMs, F onExpire) {
+        uint64_t now = nowMs / tickMs;
+        while (current <= now) {
+            int idx = current & (ROOT_SIZE - 1);
+            if (idx == 0) {
+                cascade(0);
+            }
+            TimerNode due;
+            splice(root[idx], due);
+            current++;
+            while (due.next != &due) {
+                TimerNode *node = due.next;
+                unlink(node);
+                count--;
+                onExpire(node);
+            }
+        }
+    }
+
+    // Milliseconds the event loop may sleep, -1 when nothing is pending.
+    // Looks for the first busy root slot, or else wakes up for the cascade.
+    int timeoutMs(uint64_t nowMs) const {
+        if (count == 0) {
+            return -1;
+        }
+        uint64_t tick = current;
+        uint64_t cascadeAt = current & (ROOT_SIZE - 1)
+                                 ? (current | (ROOT_SIZE - 1)) + 1
+                                 : current;
+        while (tick < cascadeAt) {
+            const TimerNode &head = root[tick & (ROOT_SIZE - 1)];
+            if (head.next != &head) {
+                break;
+            }
+            tick++;
+        }
+        uint64_t dueMs = tick * tickMs;
+        return dueMs > nowMs ? (int)(dueMs - nowMs) : 0;
+    }
+};
+
+// Limits applied to every client connection, 0 leaves a limit off
+struct SessionTimeouts {
+    uint64_t idleMs = 0;  // no input for this long
+    uint64_t loginMs = 0; // total session length
+    int keepalive = 0;    // seconds of silence before TCP keepalive probes
+
+    // Half-open connections (peer vanished without FIN) fail with ETIMEDOUT
+    // once the probes go unanswered, which the read path treats as a logout.
+    void setupSocket(int fd) const {
+        if (keepalive <= 0) {
+            return;
+        }
+        int on = 1;
+        int interval = keepalive / 3 > 0 ? keepalive / 3 : 1;
+        int probes = 3;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive,
+                   sizeof(keepalive));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                   sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    }
+};
@@ -0,0 +1,59 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Optional AF_UNIX stream listener next to the TCP one, for clients on the
+// same host (console.cgi, np_loadgen, admin tools). Sessions behave exactly
+// like TCP ones, only `who` shows the peer's credentials instead of IP:port.
+// A path starting with '@' names a socket in the abstract namespace.
+
+inline int createUnixSocket(const std::string &path, int backlog) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "unix socket path too long: %s\n", path.c_str());
+        return -1;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    socklen_t len = offsetof(sockaddr_un, sun_path) + path.size();
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0'; // abstract, vanishes with the server
+    } else {
+        unlink(path.c_str()); // left behind by an earlier run
+        len++;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, len) < 0 ||
+        listen(fd, backlog) < 0) {
+        perror("unix socket");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// What `who` shows for an accepted connection: IP:port for TCP, the peer's
+// uid and pid for AF_UNIX. Short enough for np_multi_proc's fixed field.
+inline std::string peerName(int fd, const sockaddr_storage &addr) {
+    if (addr.ss_family == AF_UNIX) {
+        ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+            return "unix";
+        }
+        return "uid=" + std::to_string(cred.uid) +
+               ",pid=" + std::to_string(cred.pid);
+    }
+    const sockaddr_in &in = (const sockaddr_in &)addr;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &in.sin_addr, ip, sizeof(ip));
+    return std::string(ip) + ":" + std::to_string(ntohs(in.sin_port));
+}
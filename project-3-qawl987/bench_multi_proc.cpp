@@ -0,0 +1,143 @@
+#include "user_directory.cpp"
+#include <chrono>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+#define MAXUSER 30
+
+// Micro benchmarks for the np_multi_proc shared state, with processes like
+// the server has.
+// Usage: bench_multi_proc directory [readers] [writers] [seconds] [users]
+//
+// directory: reader processes scan the user list like `who` while writer
+// processes rename their users and bump their byte counters like the user
+// loop does. A name carries its rename counter twice, a record with two
+// different counters is torn. "seqlock" reads through UserDirectory::read,
+// "unlocked" copies the record directly as np_multi_proc used to.
+
+using Clock = chrono::steady_clock;
+
+struct alignas(64) WorkerCount {
+    atomic<uint64_t> ops;
+    atomic<uint64_t> torn;
+};
+
+struct Shared {
+    atomic<bool> stop;
+    WorkerCount counts[64];
+};
+
+bool tornRecord(const UserRecord &user) {
+    int id;
+    unsigned first, second;
+    if (sscanf(user.name, "u%d-%u-%u", &id, &first, &second) != 3) {
+        return false; // not renamed yet
+    }
+    return first != second || id != user.id;
+}
+
+void readerLoop(UserDirectory *dir, Shared *shared, int worker, bool seqlock) {
+    WorkerCount &count = shared->counts[worker];
+    uint64_t ops = 0, torn = 0;
+    while (!shared->stop.load(memory_order_relaxed)) {
+        for (int id = 1; id <= dir->capacity(); id++) {
+            UserRecord user;
+            if (seqlock) {
+                user = dir->read(id);
+            } else {
+                memcpy(&user, (const void *)&dir->slot(id).record,
+                       sizeof(user));
+            }
+            torn += tornRecord(user);
+            ops++;
+        }
+    }
+    count.ops = ops;
+    count.torn = torn;
+}
+
+void writerLoop(UserDirectory *dir, Shared *shared, int worker, int writers) {
+    WorkerCount &count = shared->counts[worker];
+    uint64_t ops = 0;
+    char name[USER_NAME_SIZE];
+    for (unsigned round = 1; !shared->stop.load(memory_order_relaxed);
+         round++) {
+        for (int id = 1 + worker % writers; id <= dir->capacity();
+             id += writers) {
+            snprintf(name, sizeof(name), "u%d-%u-%u", id, round, round);
+            dir->rename(id, name);
+            dir->slot(id).bytesIn.fetch_add(1, memory_order_relaxed);
+            ops++;
+        }
+    }
+    count.ops = ops;
+}
+
+void directoryContention(int readers, int writers, int seconds, int users) {
+    printf("user directory: %d users, %d readers, %d writers, %ds\n", users,
+           readers, writers, seconds);
+    for (bool seqlock : {true, false}) {
+        size_t size = UserDirectory::bytes(users) + sizeof(Shared);
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        UserDirectory *dir = UserDirectory::create(mem, users);
+        Shared *shared =
+            new ((char *)mem + UserDirectory::bytes(users)) Shared();
+        for (int id = 1; id <= users; id++) {
+            dir->login(id, "bench:" + to_string(id));
+        }
+
+        vector<pid_t> children;
+        for (int worker = 0; worker < readers + writers; worker++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                if (worker < readers) {
+                    readerLoop(dir, shared, worker, seqlock);
+                } else {
+                    writerLoop(dir, shared, worker, writers);
+                }
+                _exit(0);
+            }
+            children.push_back(pid);
+        }
+        Clock::time_point start = Clock::now();
+        this_thread::sleep_for(chrono::seconds(seconds));
+        shared->stop = true;
+        for (pid_t pid : children) {
+            waitpid(pid, nullptr, 0);
+        }
+        double secs = chrono::duration<double>(Clock::now() - start).count();
+
+        uint64_t reads = 0, torn = 0, renames = 0;
+        for (int worker = 0; worker < readers + writers; worker++) {
+            if (worker < readers) {
+                reads += shared->counts[worker].ops;
+                torn += shared->counts[worker].torn;
+            } else {
+                renames += shared->counts[worker].ops;
+            }
+        }
+        printf("%-10s reads %10.0f/s  renames %9.0f/s  torn reads %lu\n",
+               seqlock ? "seqlock" : "unlocked", reads / secs, renames / secs,
+               (unsigned long)torn);
+        munmap(mem, size);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "directory";
+    if (mode == "directory") {
+        int cores = max(2u, thread::hardware_concurrency());
+        int readers = argc > 2 ? atoi(argv[2]) : cores / 2;
+        int writers = argc > 3 ? atoi(argv[3]) : cores / 2;
+        directoryContention(min(max(1, readers), 32),
+                            min(max(1, writers), 32),
+                            argc > 4 ? atoi(argv[4]) : 2,
+                            argc > 5 ? atoi(argv[5]) : MAXUSER);
+    }
+    return 0;
+}
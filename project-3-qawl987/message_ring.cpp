@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <atomic>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+// Message channels of np_multi_proc, in shared memory: the broadcast ring
+// every process reads, and one mailbox per user for messages to that user
+// alone. A sender claims sequence numbers with one fetch_add and copies its
+// message into consecutive slots, then wakes the readers that went to
+// sleep. Readers go at their own pace with a private cursor, nobody relays
+// or serializes messages. Slots follow the seqlock pattern: a reader that
+// fell a whole ring behind notices its slot was reused and is lapped. The
+// flag a reader raises before it blocks is its own, one for all channels it
+// reads (see UserSlot).
+//
+// A sender killed halfway leaves slots claimed but never published, where
+// every reader would stop. So slots carry the sender's pid and senders note
+// what they are claiming; the master's supervisor fills what a dead sender
+// left with empty messages (recover()), which readers skip.
+#define RING_SLOT_DATA 238 // message bytes per slot, 256 with the header
+
+struct RingSlot {
+    std::atomic<uint64_t> state; // 2*seq+1 while written, 2*seq+2 after
+    int32_t owner; // pid of the sender
+    uint16_t part; // index of this slot within the message
+    uint16_t parts;
+    uint16_t len; // bytes used in data
+    char data[RING_SLOT_DATA];
+};
+
+
+// SLOTS must be a power of two
+template <unsigned SLOTS> class MessageRing {
+  public:
+    enum Result { MESSAGE, EMPTY, LAPPED };
+
+    // On fresh shared memory, before any reader exists
+    void init() {
+        head = 0;
+        for (RingSlot &slot : slots) {
+            slot.state = 0;
+        }
+    }
+
+    // Append msg as sender owner, then wake() the readers. Returns the
+    // sequence number the message starts at. claim is the sender's note for
+    // the supervisor: 1 + a sequence number at or before the first slot it
+    // takes, 0 when it is done.
+    uint64_t publish(const std::string &msg, pid_t owner,
+                     std::atomic<uint64_t> &claim) {
+        uint16_t parts = msg.empty() ? 1
+                                     : (msg.size() + RING_SLOT_DATA - 1) /
+                                           RING_SLOT_DATA;
+        claim.store(head.load() + 1);
+        uint64_t seq = head.fetch_add(parts);
+        for (uint16_t i = 0; i < parts; i++) {
+            uint64_t at = seq + i;
+            RingSlot &slot = slots[at & (SLOTS - 1)];
+            if (!take(slot, at)) {
+                continue; // recover()ed for us, we were taken for dead
+            }
+            slot.owner = owner;
+            std::atomic_thread_fence(std::memory_order_release);
+            size_t offset = (size_t)i * RING_SLOT_DATA;
+            slot.part = i;
+            slot.parts = parts;
+            slot.len = std::min(msg.size() - std::min(msg.size(), offset),
+                                (size_t)RING_SLOT_DATA);
+            memcpy(slot.data, msg.data() + offset, slot.len);
+            slot.state.store(2 * at + 2, std::memory_order_release);
+        }
+        claim.store(0, std::memory_order_release);
+        // pairs with the fence in sleep(): either the reader sees the
+        // message or wake() sees it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return seq;
+    }
+
+    // Ring the eventfd of a reader that is blocked, or about to
+    static void wake(std::atomic<uint32_t> &sleeping, int eventFd) {
+        if (sleeping.load() && sleeping.exchange(0)) {
+            uint64_t one = 1;
+            write(eventFd, &one, sizeof(one));
+        }
+    }
+
+    // Copy the message starting at seq and move seq past it. On LAPPED seq
+    // is moved to the oldest message still intact.
+    Result read(uint64_t &seq, std::string &msg) const {
+        const RingSlot &first = slots[seq & (SLOTS - 1)];
+        uint64_t state = first.state.load(std::memory_order_acquire);
+        if (state < 2 * seq + 2) {
+            return EMPTY; // not published yet
+        }
+        if (state > 2 * seq + 2 || first.part != 0) {
+            resync(seq);
+            return LAPPED;
+        }
+        uint16_t parts = first.parts;
+        msg.clear();
+        for (uint16_t i = 0; i < parts; i++) {
+            uint64_t at = seq + i;
+            const RingSlot &slot = slots[at & (SLOTS - 1)];
+            uint64_t before = slot.state.load(std::memory_order_acquire);
+            if (before < 2 * at + 2) {
+                return EMPTY; // later parts still being copied
+            }
+            uint16_t part = slot.part;
+            size_t len = std::min<size_t>(slot.len, RING_SLOT_DATA);
+            msg.append(slot.data, len);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before != 2 * at + 2 ||
+                slot.state.load(std::memory_order_relaxed) != before) {
+                resync(seq);
+                return LAPPED;
+            }
+            if (part != i) { // its sender died, the rest was recover()ed
+                msg.clear();
+                seq = at;
+                return MESSAGE;
+            }
+        }
+        seq += parts;
+        return MESSAGE;
+    }
+
+    // A message was claimed at seq but is not readable yet
+    bool claimed(uint64_t seq) const { return head.load() > seq; }
+
+    uint64_t end() const { return head.load(); }
+
+    // Announce that the reader is about to block in poll, and clear the
+    // flag again after it. Returns false when a message arrived meanwhile,
+    // so the reader must not block.
+    bool sleep(std::atomic<uint32_t> &sleeping, uint64_t seq) {
+        sleeping.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const RingSlot &slot = slots[seq & (SLOTS - 1)];
+        if (slot.state.load(std::memory_order_acquire) >= 2 * seq + 2) {
+            sleeping.store(0);
+            return false;
+        }
+        return true;
+    }
+
+    // The sender owner died with claim set: publish an empty message in
+    // each slot from claim up to end that it took but did not publish.
+    // Slots nobody started copying into yet may still belong to a live
+    // sender that is about to, they are only filled when force is set.
+    // Returns whether none of those were left.
+    bool recover(pid_t owner, uint64_t claim, uint64_t end, bool force) {
+        bool settled = true;
+        uint64_t from = std::max(claim - 1, end > SLOTS ? end - SLOTS : 0);
+        for (uint64_t at = from; at < end; at++) {
+            RingSlot &slot = slots[at & (SLOTS - 1)];
+            uint64_t state = slot.state.load(std::memory_order_acquire);
+            if (state >= 2 * at + 2 ||
+                (state == 2 * at + 1 && slot.owner != owner)) {
+                continue; // published, reused, or being copied by another
+            }
+            if (state < 2 * at + 1 && !force) {
+                settled = false;
+                continue;
+            }
+            // a sender a lap later may take the slot over meanwhile
+            if (!slot.state.compare_exchange_strong(state, 2 * at + 1)) {
+                continue;
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.owner = getpid();
+            slot.part = 0;
+            slot.parts = 1;
+            slot.len = 0;
+            slot.state.store(2 * at + 2, std::memory_order_release);
+        }
+        return settled;
+    }
+
+  private:
+    std::atomic<uint64_t> head; // next sequence number to claim
+
+    // Mark slot as being written for seq at, once the sender a whole lap
+    // earlier published its message there. That one may have claimed the
+    // slot and not started, or still be copying: wait, unless it died while
+    // copying. One that died before it started is recover()ed by the
+    // supervisor. False when the slot is past at already, recover()ed
+    // because we looked dead: it must not move back.
+    bool take(RingSlot &slot, uint64_t at) {
+        uint64_t previous = at >= SLOTS ? at - SLOTS : 0;
+        uint64_t state = slot.state.load(std::memory_order_acquire);
+        for (unsigned spins = 1;; spins++) {
+            if (state >= 2 * at + 1) {
+                return false;
+            }
+            bool ready = at < SLOTS || state >= 2 * previous + 2 ||
+                         (state == 2 * previous + 1 && spins % 1024 == 0 &&
+                          !processAlive(slot.owner));
+            if (ready &&
+                slot.state.compare_exchange_weak(state, 2 * at + 1,
+                                                 std::memory_order_relaxed)) {
+                return true;
+            }
+            if (!ready) {
+                sched_yield();
+                state = slot.state.load(std::memory_order_acquire);
+            }
+        }
+    }
+
+    alignas(64) RingSlot slots[SLOTS]; // not on the line senders bounce
+
+    // Oldest slot that can't be overwritten before we get to it, then
+    // forward to the start of a message
+    void resync(uint64_t &seq) const {
+        uint64_t now = head.load();
+        uint64_t oldest = now > SLOTS / 2 ? now - SLOTS / 2 : 0;
+        seq = std::max(seq + 1, oldest);
+        while (seq < now) {
+            const RingSlot &slot = slots[seq & (SLOTS - 1)];
+            if (slot.state.load(std::memory_order_acquire) == 2 * seq + 2 &&
+                slot.part == 0) {
+                break;
+            }
+            seq++;
+        }
+    }
+};
+
+typedef MessageRing<4096> BroadcastRing;
+typedef MessageRing<256> Mailbox;
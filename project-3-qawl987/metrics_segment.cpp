@@ -0,0 +1,132 @@
+#include <atomic>
+#include <initializer_list>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// np_multi_proc's counters for readers outside the server, npstat above
+// all, in a shared memory object of their own (METRICS_SHM_NAME). Every
+// process writes only its own slot, the master slot 0 and a user process
+// the slot of its user ID: counting is a relaxed load and store on a cache
+// line no other process writes, no locked instruction on the hot path.
+// Readers map the object read-only and turn the counters into rates. The
+// header names the layout, a reader built for another one refuses the
+// segment instead of misreading it.
+#define METRICS_SHM_NAME "/np_multi_proc_metrics"
+#define METRICS_MAGIC 0x6e706d73 // "npms"
+#define METRICS_VERSION 1
+#define METRICS_FORK_BUCKETS 24
+
+struct alignas(64) MetricsSlot {
+    // bumped whenever a process takes the slot over, its counters restart
+    std::atomic<uint32_t> session;
+    std::atomic<int32_t> pid; // 0 while nobody has the slot
+    std::atomic<uint64_t> commands; // input lines run
+    std::atomic<uint64_t> forks;
+    std::atomic<uint64_t> forkNs; // spent in fork(), the parent's side
+    std::atomic<uint64_t> pipesOut; // user pipes sent
+    std::atomic<uint64_t> pipesIn;  // and read
+    // through bulk user pipes, the only ones whose data the shell sees
+    std::atomic<uint64_t> pipeBytesOut;
+    std::atomic<uint64_t> pipeBytesIn;
+    std::atomic<uint64_t> messagesSent;     // into the ring or a mailbox
+    std::atomic<uint64_t> messagesReceived; // for this user, from others
+    // waiting on other processes: publishing messages, where a sender may
+    // wait for slots one a lap earlier still copies into, and bulk user
+    // pipes whose writer still runs
+    std::atomic<uint64_t> waitNs;
+    // forks by fork() time, bucket b under 2^b microseconds, the last one
+    // the rest
+    std::atomic<uint64_t> forkUs[METRICS_FORK_BUCKETS];
+};
+
+class MetricsSegment {
+  public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotSize;
+    int32_t capacity;
+    int32_t serverPid;
+    uint64_t startNs; // CLOCK_MONOTONIC
+
+    static size_t bytes(int capacity) {
+        return slotsOffset() + sizeof(MetricsSlot) * (capacity + 1);
+    }
+
+    // Build a segment in zeroed memory of bytes(capacity)
+    static MetricsSegment *create(void *mem, int capacity, pid_t serverPid,
+                                  uint64_t startNs) {
+        MetricsSegment *seg = new (mem) MetricsSegment();
+        seg->slotSize = sizeof(MetricsSlot);
+        seg->capacity = capacity;
+        seg->serverPid = serverPid;
+        seg->startNs = startNs;
+        seg->version = METRICS_VERSION;
+        std::atomic_thread_fence(std::memory_order_release);
+        seg->magic = METRICS_MAGIC; // last, a reader may be waiting for it
+        return seg;
+    }
+
+    // The segment in a mapping of size bytes, nullptr when it is not one
+    // of this layout
+    static const MetricsSegment *open(const void *mem, size_t size) {
+        const MetricsSegment *seg = (const MetricsSegment *)mem;
+        if (size < sizeof(MetricsSegment) || seg->magic != METRICS_MAGIC ||
+            seg->version != METRICS_VERSION ||
+            seg->slotSize != sizeof(MetricsSlot) || seg->capacity < 0 ||
+            size < bytes(seg->capacity)) {
+            return nullptr;
+        }
+        return seg;
+    }
+
+    MetricsSlot &slot(int id) {
+        return ((MetricsSlot *)((char *)this + slotsOffset()))[id];
+    }
+    const MetricsSlot &slot(int id) const {
+        return ((const MetricsSlot *)((const char *)this + slotsOffset()))[id];
+    }
+
+    // Process pid takes slot id over, with its counters at zero
+    void begin(int id, pid_t pid) {
+        MetricsSlot &s = slot(id);
+        s.pid.store(0, std::memory_order_relaxed);
+        s.session.fetch_add(1, std::memory_order_relaxed);
+        for (std::atomic<uint64_t> *c :
+             {&s.commands, &s.forks, &s.forkNs, &s.pipesOut, &s.pipesIn,
+              &s.pipeBytesOut, &s.pipeBytesIn, &s.messagesSent,
+              &s.messagesReceived, &s.waitNs}) {
+            c->store(0, std::memory_order_relaxed);
+        }
+        for (std::atomic<uint64_t> &c : s.forkUs) {
+            c.store(0, std::memory_order_relaxed);
+        }
+        s.pid.store(pid, std::memory_order_release);
+    }
+
+    void end(int id) { slot(id).pid.store(0, std::memory_order_release); }
+
+    // Only the slot's owner counts, no read-modify-write needed
+    static void add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    static void recordFork(MetricsSlot &s, uint64_t ns) {
+        add(s.forks);
+        add(s.forkNs, ns);
+        add(s.forkUs[forkBucket(ns / 1000)]);
+    }
+
+    static int forkBucket(uint64_t us) {
+        int b = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        return b < METRICS_FORK_BUCKETS ? b : METRICS_FORK_BUCKETS - 1;
+    }
+
+  private:
+    static size_t slotsOffset() {
+        return (sizeof(MetricsSegment) + alignof(MetricsSlot) - 1) /
+               alignof(MetricsSlot) * alignof(MetricsSlot);
+    }
+};
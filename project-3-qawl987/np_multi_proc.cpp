@@ -1,22 +1,37 @@
 #include "npshell_multi_proc.cpp"
+#include "../project-2-qawl987/admission.cpp"
+#include "../project-2-qawl987/session_capture.cpp"
+#include "../project-2-qawl987/tcp_output.cpp"
+#include "../project-2-qawl987/timer_wheel.cpp"
+#include "../project-2-qawl987/unix_listener.cpp"
 #include <arpa/inet.h>
 #include <atomic>
 #include <chrono>
 #include <csignal>
 #include <filesystem>
+#include <getopt.h>
 #include <limits.h>
 #include <map>
 #include <poll.h>
-#include <semaphore.h>
 #include <set>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/shm.h>
 #include <sys/stat.h> // add
+#include <sys/syscall.h>
 #include <thread>
 #define MAX_LINE 15000
 #define MAXUSER 30
 #define PROMPT "% "
+#define TIMER_TICK_MS 250
+// How long slots a dead sender claimed but did not start are left to a live
+// sender that might have them, see MessageRing::recover()
+#define ABANDONED_GRACE_MS 1000
+// Quiet time after a login before the spare pool is refilled, the fork
+// would compete with the session just handed over
+#define SPARE_REFILL_DELAY_MS 2
 
 const string WELCOME_MESSAGE = "****************************************\n"
                                "** Welcome to the information server. **\n"
@@ -24,152 +39,99 @@ const string WELCOME_MESSAGE = "****************************************\n"
 
 int null_fd;
 
-UserInfo *userList;
-sem_t *read_lock;
-sem_t *write_lock;
-array<int, 2> shared_pipe;
-// Current process user FIFO <read, write> fd with [key] user.
+// Next broadcast ring and mailbox message this process reads, set by the
+// master at login
+uint64_t next_seq = 0;
+uint64_t next_direct = 0;
+// Read ends of the user pipes to this process's user, by sender ID.
 // Each client process after fork would maintain its own user_pipe_fds
-map<int, pair<int, int>> user_pipe_fds;
-
-void initUserInfos(int idx) {
-    userList[idx].isLogin = false;
-    userList[idx].id = 0;
-    userList[idx].ms_pipe = -1;
-    strcpy(userList[idx].name, "(no name)");
-    strcpy(userList[idx].ipPort, "");
-}
+map<int, int> user_pipe_fds;
+// Capture file session of this client process, assigned by the master
+uint32_t capture_session = 0;
+// Set by SIGUSR1, the master dumps the stats to stderr
+volatile sig_atomic_t stats_requested = 0;
+SessionTimeouts session_timeouts;
+AdmissionControl admission;
+int listen_backlog = SOMAXCONN;
+string unix_path; // optional AF_UNIX listener next to the TCP one
+int max_users = MAXUSER;
+int prefork_spares = 0; // --prefork: user processes kept ready for logins
+
+uint64_t monotonicMs() { return monotonicNs() / 1000000; }
+
+// Act on a broadcast message, user_id -1 for the master. Messages for
+// somebody else are dropped on the header, before the payload is read.
+void HandleInternalMsg(const string &msg, int user_id) {
+    MessageHeader header;
+    if (msg.size() < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, msg.data(), sizeof(header));
+    int sender_id = header.sender;
+    if (header.target != 0 && header.target != user_id &&
+        sender_id != user_id) {
+        return;
+    }
+    if (user_id > 0 && sender_id != user_id) {
+        MetricsSegment::add(ownMetrics().messagesReceived);
+    }
+    string name = msg.substr(sizeof(header), header.nameLen);
+    string text = msg.substr(sizeof(header) + header.nameLen, header.textLen);
 
-void HandleInternalMsg(int fd_in, int user_id) {
-    int sender_id;
-    size_t msg_len;
-    // shared_pipe[0] or ms_pipe[0]
-    // received msg from pipe
-    read(fd_in, &sender_id, sizeof(sender_id));
-    read(fd_in, &msg_len, sizeof(msg_len));
-    char msg_buf[msg_len + 1];
-    msg_buf[msg_len] = '\0';
-    read(fd_in, msg_buf, msg_len);
-    string msg(msg_buf, msg_len);
-    UserInfo *user = &userList[user_id];
-    // parse message
-    stringstream ss(msg);
-    string arg;
-    // first argument
-    getline(ss, arg, ' ');
-
-    if (arg == "login") {
-        getline(ss, arg, ' '); // tcpinfo
-        getline(ss, arg);      // msg
-        cout << arg << endl;
-    }
-
-    if (arg == "exit") {
-        // server clean up
-        if (user_id == -1) {
-            close(userList[sender_id].ms_pipe);
-            initUserInfos(sender_id);
-            getline(ss, arg); // msg
-            cout << arg << endl;
-        }
+    switch (header.type) {
+    case MSG_LOGIN:
+        cout << "*** User '" << name << "' entered from " << text << ". ***"
+             << endl;
+        break;
+
+    case MSG_EXIT:
         if (user_id == sender_id) {
-            // close exit user itself create pipe
-            for (const auto &[key, val] : user_pipe_fds) {
-                // use key, first, second here
-                if (val.first != 0) {
-                    close(val.first);
-                }
-                if (val.second != 0) {
-                    close(val.second);
-                }
+            SessionCapture::record(SessionCapture::CLOSE, capture_session,
+                                   user_id);
+            receiveUserPipes(-user_id, user_pipe_fds); // unread ones
+            metrics->end(user_id);
+            userList->logout(user_id); // the master may hand out the slot again
+            // the writers hold nothing, closing our read ends is enough
+            for (const auto &[sender, read_fd] : user_pipe_fds) {
+                userList->slot(sender).bulkBytes -= BulkPipe::size(read_fd);
+                close(read_fd);
             }
             exit(0);
         }
-        // other user need to close the read, write FIFO corresponding to
-        // leaving user as well
-        if (user_pipe_fds[sender_id].first != 0) {
-            close(user_pipe_fds[sender_id].first);
-            string user_pipe_filename =
-                "user_pipe/" + to_string(user_id) + "_" + to_string(sender_id);
-            if (unlink(user_pipe_filename.c_str()) < 0) {
-                cerr << "Error: failed to unlink user pipe" << endl;
-            }
-        }
-        if (user_pipe_fds[sender_id].second != 0) {
-            close(user_pipe_fds[sender_id].second);
-            string user_pipe_filename =
-                "user_pipe/" + to_string(sender_id) + "_" + to_string(user_id);
-            if (unlink(user_pipe_filename.c_str()) < 0) {
-                cerr << "Error: failed to unlink user pipe" << endl;
+        if (user_id != -1) {
+            // other users drop the pipe the leaving user left them
+            receiveUserPipes(user_id, user_pipe_fds);
+            if (user_pipe_fds.count(sender_id)) {
+                close(user_pipe_fds[sender_id]);
+                user_pipe_fds.erase(sender_id);
             }
+            userList->pipeFrom(user_id, sender_id) = false;
         }
+        cout << "*** User '" << name << "' left. ***" << endl;
+        break;
 
-        user_pipe_fds.erase(sender_id);
-        getline(ss, arg); // msg
-        cout << arg << endl;
-    }
-
-    if (arg == "yell") {
-        getline(ss, arg); // msg
-        cout << arg << endl;
-    }
-
-    if (arg == "tell") {
-        getline(ss, arg, ' ');      // receiver_id
-        if (user_id == stoi(arg)) { // we are the receiver
-            getline(ss, arg);       // msg
-            cout << arg << endl;
-        }
-    }
-
-    if (arg == "name") {
-        getline(ss, arg); // msg
-        cout << arg << endl;
-    }
+    case MSG_YELL:
+        cout << "*** " << name << " yelled ***: " << text << endl;
+        break;
 
-    if (arg == ">") {
-        getline(ss, arg, ' '); // receiver_id
-        int receiver_id = stoi(arg);
-        if (user_id == receiver_id &&
-            sender_id != user_id) { // if it's piped to us
-            string user_pipe_filename = "./user_pipe/" +
-                                        to_string(receiver_id) + '_' +
-                                        to_string(sender_id);
-            int read_fd =
-                open(user_pipe_filename.c_str(), O_RDONLY | O_CLOEXEC);
-            if (read_fd < 0) {
-                string msg = "*** Error: Could not open pipe for reading by "
-                             "receiver. ***\n";
-                cout << msg << flush;
-            }
-            // sender: <read, write>
-            user_pipe_fds[sender_id].first = read_fd;
+    case MSG_TELL:
+        if (user_id == header.target) { // we are the receiver
+            cout << "*** " << name << " told you ***: " << text << endl;
         }
-        // avoid printing kBash
-        return;
-    }
+        break;
 
-    if (arg == "<") {
-        getline(ss, arg, ' '); // sender_id
-        int pipe_out_id = stoi(arg);
-        // sender_id is FIFO receiver, pipe_out_id is FIFO sender
-        if (user_id == pipe_out_id &&
-            sender_id != user_id) { // we are the pipe_out user
-            // close it
-            close(user_pipe_fds[sender_id].second);
-            user_pipe_fds[sender_id].second = 0;
-        }
-        return;
-    }
+    case MSG_NAME:
+        cout << "*** User from " << text << " is named '" << name << "'. ***"
+             << endl;
+        break;
 
-    if (arg == "user_pipe") {
+    case MSG_USER_PIPE:
         if (sender_id == user_id) {
-            // avoid printing msg and kBash
+            // printed when sent, avoid printing msg and kBash
             return;
         }
-        while (getline(ss, arg)) { // msg (maybe more than one)
-            cout << arg << endl << flush;
-        }
+        cout << text << flush; // msg (maybe more than one)
+        break;
     }
     // EX: ue1: yell abc, ue1 need print broadcast message before print prompt.
     if (sender_id == user_id) {
@@ -177,12 +139,17 @@ void HandleInternalMsg(int fd_in, int user_id) {
     }
 }
 
+// -1 when the client hung up, the user then leaves the way `exit` does
 int Shell(int user_id, PipeManager &pipe_manager,
-          map<int, pair<int, int>> &user_pipe_fds) {
+          map<int, int> &user_pipe_fds) {
     string input;
-    getline(cin, input);
+    if (!getline(cin, input)) {
+        ProcessExecutor::broadcastMessage(MSG_EXIT, user_id,
+                                          userList->read(user_id).name);
+        return -1;
+    }
+    SessionCapture::recordLine(capture_session, user_id, input);
 
-    UserInfo *user = &userList[user_id];
     input.erase(input.find_last_not_of(" \n\r\t") +
                 1); // remove trailing whitespace
 
@@ -191,9 +158,12 @@ int Shell(int user_id, PipeManager &pipe_manager,
         return 0;
     }
 
-    CommandParser parser(input, pipe_manager, user_id, read_lock, write_lock,
-                         shared_pipe, userList, user_pipe_fds);
+    uint64_t start = monotonicNs();
+    CommandParser parser(input, pipe_manager, user_id, userList,
+                         user_pipe_fds);
     bool need_bash = parser.processCommands();
+    serverStats->shellNs.record(monotonicNs() - start);
+    MetricsSegment::add(ownMetrics().commands);
     // Some command can't print prompt here, need receive broadcast message
     // first. EX: ue1: yell abc, ue1 need print broadcast message before print
     // prompt.
@@ -202,13 +172,136 @@ int Shell(int user_id, PipeManager &pipe_manager,
     return 0;
 }
 
+// A session limit ran out: stop reading the client and leave the same way
+// `exit` does, the process ends once it reads the message back
+void expireSession(int user_id, bool login_limit) {
+    cout << "*** Session closed: "
+         << (login_limit ? "login time limit reached" : "idle for too long")
+         << ". ***" << endl;
+    ProcessExecutor::broadcastMessage(MSG_EXIT, user_id,
+                                      userList->read(user_id).name);
+}
+
+// The ring or the mailbox lapped this process, drop the user pipes of the
+// users whose `exit` it missed
+void resyncUserPipes(int user_id) {
+    receiveUserPipes(user_id, user_pipe_fds);
+    for (auto it = user_pipe_fds.begin(); it != user_pipe_fds.end();) {
+        if (userList->isLogin(it->first)) {
+            ++it;
+            continue;
+        }
+        close(it->second);
+        userList->pipeFrom(user_id, it->first) = false;
+        it = user_pipe_fds.erase(it);
+    }
+}
+
+// Handle the ring messages before seq until that are ready, user_id -1 for
+// the master. A lapped reader skips what was overwritten, own messages are
+// still handled from the outbox since the prompt and `exit` depend on them.
+void deliverBroadcasts(int user_id, uint64_t until) {
+    string msg;
+    while (next_seq < until) {
+        uint64_t seq = next_seq;
+        BroadcastRing::Result result = messageRing->read(next_seq, msg);
+        if (result == BroadcastRing::EMPTY) {
+            return;
+        }
+        if (result == BroadcastRing::LAPPED) {
+            serverStats->overruns++;
+            if (user_id == -1) {
+                cout << "[Server] Broadcast ring overrun, messages lost"
+                     << endl;
+                continue;
+            }
+            cout << "*** Some messages were lost, you fell too far behind. ***"
+                 << endl;
+            resyncUserPipes(user_id);
+            while (!outbox.empty() && outbox.front().first < next_seq) {
+                pair<uint64_t, string> own = move(outbox.front());
+                outbox.pop_front();
+                HandleInternalMsg(own.second, user_id);
+            }
+            continue;
+        }
+        if (!outbox.empty() && outbox.front().first == seq) {
+            outbox.pop_front();
+        }
+        HandleInternalMsg(msg, user_id);
+    }
+}
+
+// Everything ready in the ring, then in our mailbox
+void deliverMessages(int user_id) {
+    deliverBroadcasts(user_id, UINT64_MAX);
+    if (user_id == -1) {
+        return;
+    }
+    string msg;
+    while (true) {
+        Mailbox::Result result = mailboxes[user_id].read(next_direct, msg);
+        if (result == Mailbox::EMPTY) {
+            return;
+        }
+        if (result == Mailbox::LAPPED) {
+            serverStats->overruns++;
+            cout << "*** Some messages were lost, you fell too far behind. ***"
+                 << endl;
+            resyncUserPipes(user_id);
+            continue;
+        }
+        MessageHeader header;
+        memcpy(&header, msg.data(), min(msg.size(), sizeof(header)));
+        deliverBroadcasts(user_id, header.ringSeq);
+        HandleInternalMsg(msg, user_id);
+    }
+}
+
 class Server {
   private:
     int tcp_fd_;
+    int unix_fd_ = -1;
     sockaddr_in tcp_addr_;
 
     bool listening_ = false;
-    array<pollfd, 2> fds_;
+    array<pollfd, 3> fds_;
+
+    // The master's supervisor: every user process with its pidfd, -1 where
+    // the kernel has none and kill() is polled instead
+    struct Child {
+        int user_id;
+        pid_t pid;
+        int pidfd;
+    };
+    vector<Child> children_;
+    // Messages of dead processes still to finish, see MessageRing::recover()
+    struct Abandoned {
+        pid_t owner;
+        uint64_t claim;
+        int channel;      // -1 the broadcast ring, else a mailbox
+        uint64_t end;     // of the channel when the owner was found dead
+        uint64_t forceMs; // from then on, take the slots nobody started too
+    };
+    vector<Abandoned> abandoned_;
+    // What a user process needs to start a session, sent to a spare along
+    // with the client socket
+    struct Login {
+        int32_t user_id;
+        uint32_t capture_session;
+        uint64_t first_seq;
+        uint64_t first_direct;
+    };
+    // --prefork: user processes forked ahead, already attached to the
+    // shared memory and waiting on control (the master's end of a seqpacket
+    // socketpair) for a Login. Each serves one session.
+    struct Spare {
+        pid_t pid;
+        int pidfd;
+        int control;
+    };
+    vector<Spare> spares_;
+    uint64_t spare_due_ms_ = 0; // next refill, put off by logins
 
     // void (*service_function_)(int user_id,
     //                           unordered_map<int, array<int, 2>> &pipeMap);
@@ -223,67 +316,118 @@ class Server {
         return ss.str();
     }
 
-    int userLogin(int client_fd, sockaddr_in client_address, int pipe_fd) {
-        char ipBuf[INET_ADDRSTRLEN];
-        string ip = inet_ntoa(client_address.sin_addr);
-        string clientIP = inet_ntop(AF_INET, &client_address.sin_addr, ipBuf,
-                                    sizeof(clientIP));
-        string clientPort = to_string(ntohs(client_address.sin_port));
-        string ipPort = clientIP + ":" + clientPort;
+    int userLogin(int client_fd, const string &ipPort) {
         // Find the first available user slot
-        for (int idx = 1; idx <= MAXUSER; idx++) {
-            if (!userList[idx].isLogin) {
-                PipeManager pipeManager;
-                userList[idx].isLogin = true;
-                userList[idx].id = idx;
-                userList[idx].ms_pipe = pipe_fd;
-                strcpy(userList[idx].ipPort, ipPort.c_str());
-                return idx;
-            }
+        int idx = userList->freeSlot();
+        if (idx != 0) {
+            // late user pipes to the slot's last user
+            receiveUserPipes(-idx, user_pipe_fds);
+            userList->login(idx, ipPort);
         }
-        return 0;
+        return idx;
     }
 
-    void handleConnection() {
-        struct sockaddr_in client_address;
+    void handleConnection(int listen_fd) {
+        struct sockaddr_storage client_address;
         socklen_t alen = sizeof(client_address);
         int client_fd =
-            accept(tcp_fd_, (struct sockaddr *)&client_address, &alen);
+            accept(listen_fd, (struct sockaddr *)&client_address, &alen);
+        if (client_fd < 0) { // gone before we got to it, or out of fds
+            cerr << "accept: " << strerror(errno) << endl;
+            return;
+        }
+        if (!admission.admit(monotonicNs())) {
+            serverStats->rejected++;
+            AdmissionControl::reject(client_fd, SERVER_BUSY_MESSAGE);
+            return;
+        }
 
-        // Create pipe for server-client communication, [0]: client read, [1]: server write
-        array<int, 2> ms_pipe;
-        while (pipe2(ms_pipe.data(), O_CLOEXEC) == -1) {
-            if (errno == EMFILE || errno == ENFILE) {
-                wait(nullptr); // wait for any child process to release resource
-            }
+        // the user reads what is published once it is listed, as `tell` and
+        // the others see it
+        uint64_t first_seq = messageRing->end();
+        int user_id = userLogin(client_fd, peerName(client_fd, client_address));
+        if (user_id == 0) { // every slot is taken
+            serverStats->rejected++;
+            AdmissionControl::reject(client_fd, SERVER_FULL_MESSAGE);
+            return;
+        }
+        // what was left for the last user of the slot is not ours
+        Login login = {user_id, SessionCapture::newSession(), first_seq,
+                       mailboxes[user_id].end()};
+        if (handOff(client_fd, login)) {
+            close(client_fd);
+            return;
         }
-        int user_id = userLogin(client_fd, client_address, ms_pipe[1]);
-        UserInfo *user = &userList[user_id];
 
+        cout << flush; // what the master wrote is not the client's
         pid_t child;
+        uint64_t start = monotonicNs();
         while ((child = fork()) == -1) {
             if (errno == EAGAIN) {
                 wait(nullptr); // wait for any child process to release resource
             }
+            start = monotonicNs();
         }
 
         if (child != 0) { // parent process
+            serverStats->forks++;
+            MetricsSegment::recordFork(ownMetrics(), monotonicNs() - start);
             close(client_fd);
-            close(ms_pipe[0]);
+            userList->slot(user_id).pid = child;
+            children_.push_back({user_id, child,
+                                 (int)syscall(SYS_pidfd_open, child, 0)});
             return;
         }
 
         /* child process ------------------------------- */
+        leaveMaster();
+        serveUser(client_fd, login);
+    }
+
+    // Right after fork, drop what only the master uses
+    void leaveMaster() {
+        signal(SIGPIPE, SIG_DFL); // commands expect the default again
+        signal(SIGUSR1, SIG_DFL);
         close(tcp_fd_);
-        close(shared_pipe[0]);
-        // userList[i].ms_pipe is ms_pipe[1] close unused
-        for (int i = 1; i <= MAXUSER; i++) {
-            if (userList[i].isLogin) {
-                close(userList[i].ms_pipe);
+        if (unix_fd_ >= 0) {
+            close(unix_fd_);
+        }
+        for (const Child &sibling : children_) {
+            if (sibling.pidfd >= 0) {
+                close(sibling.pidfd);
+            }
+        }
+        for (const Spare &spare : spares_) {
+            if (spare.pidfd >= 0) {
+                close(spare.pidfd);
             }
+            close(spare.control);
         }
+        children_.clear();
+        abandoned_.clear();
+        spares_.clear();
+        selfPid = getpid();
+    }
+
+    // The user process's side of a login, a fresh fork's or a spare's.
+    // Runs the session until the user leaves, which exits the process.
+    [[noreturn]] void serveUser(int client_fd, const Login &login) {
+        int user_id = login.user_id;
+        UserRecord user = userList->read(user_id);
+        selfId = user_id;
+        metrics->begin(user_id, getpid());
+        capture_session = login.capture_session;
+        next_seq = login.first_seq;
+        next_direct = login.first_direct;
+        outbox.clear();
+        uint64_t stale;
+        read(wakeFds[user_id], &stale, sizeof(stale)); // the last user's
         setenv("PATH", "bin:.", 1);
+        SessionCapture::record(SessionCapture::OPEN, capture_session, user_id,
+                               user.ipPort);
 
+        TcpOutput::setup(client_fd);
+        session_timeouts.setupSocket(client_fd);
         dup2(client_fd, STDIN_FILENO);
         dup2(client_fd, STDOUT_FILENO);
         dup2(client_fd, STDERR_FILENO);
@@ -291,40 +435,260 @@ class Server {
 
         cout << WELCOME_MESSAGE;
 
-        sem_wait(write_lock);
-        write(shared_pipe[1], &user_id, sizeof(user_id));
-        string msg = "login " + string(userList[user_id].ipPort) +
-                     " *** User \'" + string(userList[user_id].name) +
-                     "\' entered from " + string(userList[user_id].ipPort) +
-                     ". ***";
-        size_t size = msg.size();
-        write(shared_pipe[1], &size, sizeof(size));
-        write(shared_pipe[1], msg.c_str(), size);
-        sem_post(read_lock);
-
-        fds_[0] = {.fd = ms_pipe[0], .events = POLL_IN, .revents = 0};
+        ProcessExecutor::broadcastMessage(MSG_LOGIN, user_id, user.name,
+                                          user.ipPort);
+
+        fds_[0] = {.fd = wakeFds[user_id], .events = POLL_IN, .revents = 0};
         fds_[1] = {.fd = STDIN_FILENO, .events = POLL_IN, .revents = 0};
+        fds_[2].fd = -1;
         // Create each process used variable
         PipeManager pipe_manager;
+        // Only this session's two timers, the wheel keeps the loop the same
+        // as np_single_proc's
+        TimerWheel timers(TIMER_TICK_MS, monotonicMs());
+        TimerNode idle_timer, login_timer;
+        if (session_timeouts.idleMs) {
+            timers.schedule(&idle_timer,
+                            monotonicMs() + session_timeouts.idleMs);
+        }
+        if (session_timeouts.loginMs) {
+            timers.schedule(&login_timer,
+                            monotonicMs() + session_timeouts.loginMs);
+        }
+        UserSlot &slot = userList->slot(user_id);
         while (true) {
-            poll(fds_.data(), fds_.size(), -1);
+            int timeout = timers.timeoutMs(monotonicMs());
+            if (!messageRing->sleep(slot.sleeping, next_seq) ||
+                !mailboxes[user_id].sleep(slot.sleeping, next_direct)) {
+                timeout = 0; // a message came in meanwhile
+            }
+            poll(fds_.data(), fds_.size(), timeout);
+            slot.sleeping = 0;
+
+            // messages, command output and the prompt of this round leave
+            // together
+            TcpOutput::cork(STDOUT_FILENO);
+            if (fds_[0].revents & POLL_IN) {
+                uint64_t wakeups;
+                read(wakeFds[user_id], &wakeups, sizeof(wakeups));
+            }
+            deliverMessages(user_id);
+            // handle client message
+            if (fds_[1].revents & POLL_IN) {
+                if (session_timeouts.idleMs) {
+                    timers.schedule(&idle_timer,
+                                    monotonicMs() + session_timeouts.idleMs);
+                }
+                if (Shell(user_id, pipe_manager, user_pipe_fds) < 0) {
+                    fds_[1].fd = -1;
+                }
+                deliverMessages(user_id); // our own, and the prompt after
+            }
+            timers.advance(monotonicMs(), [&](TimerNode *timer) {
+                timers.cancel(&idle_timer);
+                timers.cancel(&login_timer);
+                expireSession(user_id, timer == &login_timer);
+                fds_[1].fd = -1; // poll skips it from now on
+            });
+            TcpOutput::uncork(STDOUT_FILENO);
+            uint64_t bytes_in, bytes_out;
+            if (socketTraffic(STDOUT_FILENO, bytes_in, bytes_out)) {
+                slot.bytesIn.store(bytes_in, memory_order_relaxed);
+                slot.bytesOut.store(bytes_out, memory_order_relaxed);
+            }
+        }
+    }
 
-            for (pollfd pfd : fds_) {
-                if (pfd.revents & POLL_IN) {
-                    // handle internal message
-                    if (pfd.fd == ms_pipe[0]) {
-                        HandleInternalMsg(ms_pipe[0], user_id);
-                    }
+    // Fork a spare for the pool, false when fork failed
+    bool spawnSpare() {
+        int control[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) <
+            0) {
+            return false;
+        }
+        cout << flush; // what the master wrote is not the client's
+        uint64_t start = monotonicNs();
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(control[0]);
+            close(control[1]);
+            return false;
+        }
+        if (pid == 0) {
+            close(control[0]);
+            leaveMaster();
+            Login login;
+            int client_fd = receiveLogin(control[1], login);
+            if (client_fd < 0) {
+                _exit(0); // the master is gone or shrinks the pool
+            }
+            close(control[1]);
+            serveUser(client_fd, login);
+        }
+        serverStats->forks++;
+        MetricsSegment::recordFork(ownMetrics(), monotonicNs() - start);
+        close(control[1]);
+        spares_.push_back(
+            {pid, (int)syscall(SYS_pidfd_open, pid, 0), control[0]});
+        return true;
+    }
 
-                    // handle client message
-                    if (pfd.fd == STDIN_FILENO) {
-                        Shell(user_id, pipe_manager, user_pipe_fds);
-                    }
+    // Give the login to a spare, false when none is left to take it
+    bool handOff(int client_fd, const Login &login) {
+        while (!spares_.empty()) {
+            Spare spare = spares_.back();
+            spares_.pop_back();
+            // before it can run, userGone() knows the slot is its
+            userList->slot(login.user_id).pid = spare.pid;
+            bool sent = sendLogin(spare.control, login, client_fd);
+            close(spare.control);
+            if (sent) {
+                children_.push_back({login.user_id, spare.pid, spare.pidfd});
+                return true;
+            }
+            userList->slot(login.user_id).pid = 0;
+            if (spare.pidfd >= 0) { // it died waiting
+                close(spare.pidfd);
+            }
+        }
+        return false;
+    }
+
+    static bool sendLogin(int control, const Login &login, int client_fd) {
+        char buf[CMSG_SPACE(sizeof(int))] = {};
+        iovec iov = {.iov_base = (void *)&login, .iov_len = sizeof(login)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = buf;
+        msg.msg_controllen = sizeof(buf);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+        return sendmsg(control, &msg, MSG_NOSIGNAL) == sizeof(login);
+    }
+
+    // Block for the next login, the client socket or -1 at end of file
+    static int receiveLogin(int control, Login &login) {
+        char buf[CMSG_SPACE(sizeof(int))];
+        iovec iov = {.iov_base = &login, .iov_len = sizeof(login)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = buf;
+        msg.msg_controllen = sizeof(buf);
+        ssize_t n;
+        while ((n = recvmsg(control, &msg, MSG_CMSG_CLOEXEC)) < 0 &&
+               errno == EINTR) {
+        }
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (n != sizeof(login) || cmsg == nullptr ||
+            cmsg->cmsg_type != SCM_RIGHTS) {
+            return -1;
+        }
+        int client_fd;
+        memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(int));
+        return client_fd;
+    }
+
+    // Fill what dead senders left in the channels and wake the readers
+    // waiting there
+    void recoverAbandoned() {
+        uint64_t now = monotonicMs();
+        for (size_t i = 0; i < abandoned_.size();) {
+            Abandoned &lost = abandoned_[i];
+            bool force = now >= lost.forceMs;
+            bool settled;
+            if (lost.channel < 0) {
+                settled = messageRing->recover(lost.owner, lost.claim,
+                                               lost.end, force);
+                for (int id = 1; id <= userList->capacity(); id++) {
+                    BroadcastRing::wake(userList->slot(id).sleeping,
+                                        wakeFds[id]);
                 }
+            } else {
+                settled = mailboxes[lost.channel].recover(
+                    lost.owner, lost.claim, lost.end, force);
+                Mailbox::wake(userList->slot(lost.channel).sleeping,
+                              wakeFds[lost.channel]);
+            }
+            if (settled) {
+                abandoned_.erase(abandoned_.begin() + i);
+            } else {
+                i++;
             }
         }
     }
 
+    // A user process is gone. What it was in the middle of in shared memory
+    // is finished for it, and if it did not leave through `exit` (killed,
+    // crashed) its user leaves now as if it had.
+    void userGone(const Child &child) {
+        UserSlot &slot = userList->slot(child.user_id);
+        if (slot.pid != child.pid) {
+            return; // left through `exit`, the slot has a new user already
+        }
+        slot.pid = 0;
+        userList->recover(child.pid);
+        if (uint64_t claim = slot.claim.exchange(0)) {
+            int channel = slot.claimChannel;
+            uint64_t end = channel < 0 ? messageRing->end()
+                                       : mailboxes[channel].end();
+            abandoned_.push_back({child.pid, claim, channel, end,
+                                  monotonicMs() + ABANDONED_GRACE_MS});
+            recoverAbandoned();
+        }
+        if (!userList->isLogin(child.user_id)) {
+            return; // left through `exit`
+        }
+        serverStats->crashes++;
+        metrics->end(child.user_id);
+        receiveUserPipes(-child.user_id, user_pipe_fds); // never read
+        string name = userList->read(child.user_id).name;
+        userList->logout(child.user_id);
+        ProcessExecutor::broadcastMessage(MSG_EXIT, child.user_id, name);
+    }
+
+    // fds as polled: the listeners, then a pidfd for each of children_
+    // from before the poll
+    void superviseChildren(const vector<pollfd> &fds) {
+        vector<Child> running;
+        for (size_t i = 0; i < children_.size(); i++) {
+            const Child &child = children_[i];
+            size_t at = fds_.size() + i;
+            bool gone = child.pidfd >= 0
+                            ? at < fds.size() && fds[at].revents & POLLIN
+                            : !processAlive(child.pid);
+            if (!gone) {
+                running.push_back(child);
+                continue;
+            }
+            if (child.pidfd >= 0) {
+                close(child.pidfd);
+            }
+            userGone(child);
+        }
+        children_ = move(running);
+        if (!abandoned_.empty()) {
+            recoverAbandoned();
+        }
+    }
+
+    // Poll timeout while there is something to check without an fd
+    int supervisorTimeoutMs() const {
+        if (!abandoned_.empty()) {
+            return 10;
+        }
+        for (const Child &child : children_) {
+            if (child.pidfd < 0) {
+                return 1000;
+            }
+        }
+        return -1;
+    }
+
   public:
     Server(uint16_t port) {
         tcp_fd_ = socket(AF_INET, SOCK_STREAM, 0);
@@ -338,8 +702,14 @@ class Server {
         cout << "[Server] Hosting on " << inet_ntoa(tcp_addr_.sin_addr)
              << ", port " << ntohs(tcp_addr_.sin_port) << '\n';
 
-        fds_[0] = {.fd = shared_pipe[0], .events = POLL_IN, .revents = 0};
+        fds_[0] = {.fd = wakeFds[0], .events = POLL_IN, .revents = 0};
         fds_[1] = {.fd = tcp_fd_, .events = POLL_IN, .revents = 0};
+        if (!unix_path.empty() &&
+            (unix_fd_ = createUnixSocket(unix_path, listen_backlog)) < 0) {
+            exit(1);
+        }
+        // poll skips a negative fd
+        fds_[2] = {.fd = unix_fd_, .events = POLL_IN, .revents = 0};
     }
 
     ~Server() {
@@ -350,77 +720,223 @@ class Server {
 
     void listen_for_message() {
         listening_ = true;
-        listen(tcp_fd_, 1);
+        listen(tcp_fd_, listen_backlog);
 
         while (listening_) {
-            poll(fds_.data(), fds_.size(), -1);
+            // the master reads the ring only for its log, senders never
+            // wait for it
+            atomic<uint32_t> &sleeping = userList->slot(0).sleeping;
+            int timeout = messageRing->sleep(sleeping, next_seq)
+                              ? supervisorTimeoutMs()
+                              : 0;
+            // the spare pool fills up between logins
+            bool refill = spares_.size() < (size_t)prefork_spares;
+            if (refill) {
+                uint64_t now = monotonicMs();
+                int due = now >= spare_due_ms_ ? 0 : spare_due_ms_ - now;
+                if (timeout < 0 || due < timeout) {
+                    timeout = due;
+                }
+            }
+            // the listeners, then the pidfd of each user process
+            vector<pollfd> fds(fds_.begin(), fds_.end());
+            for (const Child &child : children_) {
+                fds.push_back({.fd = child.pidfd, .events = POLLIN,
+                               .revents = 0});
+            }
+            int ready = poll(fds.data(), fds.size(), timeout);
+            sleeping = 0;
+            if (ready < 0) { // interrupted, revents are stale
+                if (stats_requested) {
+                    stats_requested = 0;
+                    cerr << statsReport(userList) << flush;
+                }
+                continue;
+            }
+            uint64_t wakeup = monotonicNs();
+            serverStats->eventsPerWakeup.record(ready);
 
-            for (pollfd pfd : fds_) {
+            for (size_t i = 0; i < fds_.size(); i++) {
+                pollfd pfd = fds[i];
                 if (pfd.revents & POLL_IN) {
-                    if (pfd.fd == shared_pipe[0]) {
-                        // broadcast internal message to every client
-                        sem_wait(read_lock);
-                        for (int i = 1; i <= MAXUSER; i++) {
-                            if (userList[i].isLogin) {
-                                tee(shared_pipe[0], userList[i].ms_pipe,
-                                    INT_MAX, 0);
-                            }
-                        }
-                        // handle internal message
-                        HandleInternalMsg(shared_pipe[0], -1);
-                        sem_post(write_lock);
+                    if (pfd.fd == wakeFds[0]) {
+                        uint64_t wakeups;
+                        read(wakeFds[0], &wakeups, sizeof(wakeups));
                     }
 
-                    // new tcp connection
-                    if (pfd.fd == tcp_fd_) {
-                        handleConnection();
+                    // new tcp or unix connection
+                    if (pfd.fd == tcp_fd_ || pfd.fd == unix_fd_) {
+                        handleConnection(pfd.fd);
+                        spare_due_ms_ = monotonicMs() + SPARE_REFILL_DELAY_MS;
                     }
                 }
             }
+            superviseChildren(fds);
+            deliverMessages(-1);
+            if (refill && monotonicMs() >= spare_due_ms_ && !spawnSpare()) {
+                spare_due_ms_ = monotonicMs() + 100;
+            }
+            serverStats->loopNs.record(monotonicNs() - wakeup);
         }
     }
 };
 
-void createSharedMemory() {
-    // Create read, write lock shm
-    int shm_fd = shm_open("/my_shm", O_CREAT | O_RDWR, 0666);
-    ftruncate(shm_fd, sizeof(sem_t) * 2);
-    read_lock = (sem_t *)mmap(nullptr, sizeof(sem_t) * 2,
-                              PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    write_lock = read_lock + 1;
-    sem_init(read_lock, 1, 0);
-    sem_init(write_lock, 1, 1);
-    // Create user_list shm
-    int shm_fd_user_list =
-        shm_open("/my_shm_user_list", O_CREAT | O_RDWR, 0666);
-    ftruncate(shm_fd_user_list, sizeof(UserInfo) * (MAXUSER + 1));
-    userList = (UserInfo *)mmap(nullptr, sizeof(UserInfo) * (MAXUSER + 1),
-                                PROT_READ | PROT_WRITE, MAP_SHARED,
-                                shm_fd_user_list, 0);
+// A fresh zero filled object, so a run with a different capacity never
+// sees the last one's layout
+void *createSharedObject(const char *name, size_t size) {
+    shm_unlink(name);
+    int shm_fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    void *mem = MAP_FAILED;
+    if (shm_fd >= 0 && ftruncate(shm_fd, size) == 0) {
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd,
+                   0);
+    }
+    if (mem == MAP_FAILED) {
+        perror(name);
+        exit(1);
+    }
     close(shm_fd);
-    close(shm_fd_user_list);
-    return;
+    return mem;
+}
+
+void createSharedMemory(int capacity) {
+    // Create broadcast ring shm
+    messageRing = (BroadcastRing *)createSharedObject("/my_shm_ring",
+                                                      sizeof(BroadcastRing));
+    messageRing->init();
+    // Create mailbox shm, one per user ID
+    mailboxes = (Mailbox *)createSharedObject(
+        "/my_shm_mailbox", sizeof(Mailbox) * (capacity + 1));
+    for (int i = 0; i <= capacity; i++) {
+        mailboxes[i].init();
+    }
+    // Create user_list shm
+    userList = UserDirectory::create(
+        createSharedObject("/my_shm_user_list", UserDirectory::bytes(capacity)),
+        capacity);
+    // Create stats shm, user processes record into the master's counters
+    void *stats = createSharedObject("/my_shm_stats", sizeof(ServerStats));
+    serverStats = new (stats) ServerStats();
+    // Create metrics shm, for npstat
+    metrics = MetricsSegment::create(
+        createSharedObject(METRICS_SHM_NAME, MetricsSegment::bytes(capacity)),
+        capacity, getpid(), serverStats->startNs);
+    metrics->begin(0, getpid());
+}
+
+// Every user process inherits the wakeup eventfd and the user pipe sockets
+// of all IDs, besides its own pipes. Raise the soft limit as far as allowed
+// and tell whether that fits capacity users.
+bool reserveFds(int capacity) {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return false;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur >= 3 * (rlim_t)(capacity + 1) + 64;
 }
 
 int main(int argc, char *argv[]) {
     // Prevent zombie processes by ignoring SIGCHLD
     signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, [](int) { stats_requested = 1; });
     null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
-    // set up shared_pipe
-    pipe2(shared_pipe.data(), O_CLOEXEC);
-    createSharedMemory();
-    shm_unlink("share-mem");
-    mkdir("user_pipe", 0755);
-    // Initialize shared data
-    for (int i = 1; i <= MAXUSER; i++) {
-        initUserInfos(i);
+    selfPid = getpid();
+    static const option longOptions[] = {
+        {"capture", required_argument, nullptr, 'C'},
+        {"tcp-output", required_argument, nullptr, 'o'},
+        {"idle-timeout", required_argument, nullptr, 'i'},
+        {"login-limit", required_argument, nullptr, 'l'},
+        {"keepalive", required_argument, nullptr, 'k'},
+        {"backlog", required_argument, nullptr, 'b'},
+        {"accept-rate", required_argument, nullptr, 'r'},
+        {"accept-burst", required_argument, nullptr, 'B'},
+        {"unix", required_argument, nullptr, 'U'},
+        {"max-users", required_argument, nullptr, 'u'},
+        {"prefork", required_argument, nullptr, 'P'},
+        {"bulk-pipes", required_argument, nullptr, 'p'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "C:o:i:l:k:b:r:B:U:u:P:p:",
+                              longOptions, nullptr)) != -1) {
+        bool ok = false;
+        if (opt == 'C') {
+            ok = SessionCapture::open(optarg);
+        } else if (opt == 'o') {
+            ok = TcpOutput::parse(optarg);
+        } else if (opt == 'i' || opt == 'l') {
+            long seconds = atol(optarg);
+            ok = seconds >= 0;
+            if (opt == 'i') {
+                session_timeouts.idleMs = seconds * 1000;
+            } else {
+                session_timeouts.loginMs = seconds * 1000;
+            }
+        } else if (opt == 'k') {
+            session_timeouts.keepalive = atoi(optarg);
+            ok = session_timeouts.keepalive >= 0;
+        } else if (opt == 'b') {
+            listen_backlog = atoi(optarg);
+            ok = listen_backlog > 0;
+        } else if (opt == 'r') {
+            admission.rate = atof(optarg);
+            ok = admission.rate >= 0;
+        } else if (opt == 'B') {
+            admission.burst = atof(optarg);
+            ok = admission.burst >= 0;
+        } else if (opt == 'U') {
+            unix_path = optarg;
+            ok = true;
+        } else if (opt == 'u') {
+            max_users = atoi(optarg);
+            // user IDs travel as int16_t in message headers
+            ok = max_users > 0 && max_users <= INT16_MAX;
+        } else if (opt == 'P') {
+            prefork_spares = atoi(optarg);
+            ok = prefork_spares >= 0 && prefork_spares <= INT16_MAX;
+        } else if (opt == 'p') {
+            BulkPipe::limit = atol(optarg);
+            ok = BulkPipe::limit >= 0;
+        }
+        if (!ok) {
+            cerr << "Usage: " << argv[0]
+                 << " [--capture FILE] [--tcp-output nagle|nodelay|cork]"
+                    " [--idle-timeout SEC] [--login-limit SEC]"
+                    " [--keepalive SEC] [--backlog N] [--accept-rate N]"
+                    " [--accept-burst N] [--unix PATH|@NAME]"
+                    " [--max-users N] [--prefork N] [--bulk-pipes BYTES]"
+                    " port"
+                 << endl;
+            return 1;
+        }
     }
-    if (argc == 2) {
-        Server server(atoi(argv[1]));
+    // at most max_users sessions and prefork_spares idle processes, more
+    // spares than users never get used
+    prefork_spares = min(prefork_spares, max_users);
+    if (!reserveFds(max_users)) {
+        cerr << "Not enough file descriptors for " << max_users << " users"
+             << endl;
+        return 1;
+    }
+    // wakeups and user pipe sockets of every user, inherited by all user
+    // processes
+    wakeFds.resize(max_users + 1);
+    pipeSockets.resize(max_users + 1);
+    for (int &fd : wakeFds) {
+        fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    for (array<int, 2> &fds : pipeSockets) {
+        socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds.data());
+    }
+    createSharedMemory(max_users);
+    shm_unlink("share-mem");
+    if (argc - optind == 1) {
+        Server server(atoi(argv[optind]));
         server.listen_for_message();
     }
-    // destroy semaphores
-    sem_destroy(read_lock);
-    sem_destroy(write_lock);
     return 0;
 }
\ No newline at end of file
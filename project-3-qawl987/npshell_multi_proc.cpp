@@ -1,25 +1,31 @@
 #include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <array>
+#include <deque>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <queue>
-#include <semaphore.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
+#include "../project-2-qawl987/bulk_pipe.cpp"
+#include "../project-2-qawl987/server_stats.cpp"
 using namespace std;
 #define MAX_LINE 15000
 #define MAXUSER 30
-#define PERMS 0666
+#include "user_directory.cpp"
+#include "message_ring.cpp"
+#include "metrics_segment.cpp"
 
 class PipeManager {
 
@@ -50,15 +56,136 @@ class PipeManager {
     }
 };
 
-struct UserInfo {
-    bool isLogin; // check if the user is login
-    int id;       // range from 1 to 30
-    char name[25];
-    char ipPort[25];
-    // Master server write to here = ms_pipe[1]. Slave server read from ms_pipe[0]
-    int ms_pipe; 
+// Messages are a MessageHeader, the sender's name and a text. The receivers
+// that print one format it themselves, the others only look at the header.
+// tell goes to the target's mailbox, the rest to the broadcast ring.
+enum MessageType : uint8_t {
+    MSG_LOGIN,      // text: IP:port
+    MSG_EXIT,
+    MSG_YELL,       // text: what was yelled
+    MSG_TELL,       // text: what was told, to target's mailbox
+    MSG_NAME,       // name is the new one, text: IP:port
+    MSG_USER_PIPE,  // text: the user pipe notices, as the sender printed them
 };
 
+struct MessageHeader {
+    uint8_t type;
+    uint8_t nameLen; // bytes of name after the header
+    int16_t sender;
+    int16_t target; // user ID the message is for, 0 for everybody
+    uint32_t textLen;
+    // Directed messages: the broadcast ring's end when sent. The receiver
+    // handles the broadcasts before it first, as the sender saw them.
+    uint64_t ringSeq;
+};
+
+inline string encodeMessage(MessageType type, int sender, const string &name,
+                            const string &text, int target, uint64_t ringSeq) {
+    MessageHeader header = {};
+    header.type = type;
+    header.nameLen = min<size_t>(name.size(), UINT8_MAX);
+    header.sender = sender;
+    header.target = target;
+    header.textLen = text.size();
+    header.ringSeq = ringSeq;
+    string msg((const char *)&header, sizeof(header));
+    msg.append(name, 0, header.nameLen);
+    msg += text;
+    return msg;
+}
+
+// Shared by every process, see message_ring.cpp and user_directory.cpp,
+// sized by the capacity chosen at startup. wakeFds[id] is the eventfd user
+// id (0: the master) polls for both its ring and its mailbox, created for
+// everybody before the first fork.
+inline UserDirectory *userList;
+inline BroadcastRing *messageRing;
+inline Mailbox *mailboxes; // indexed by user ID
+inline vector<int> wakeFds;
+// This process's own messages not handled yet: <sequence number, message>
+inline deque<pair<uint64_t, string>> outbox;
+// This process's user ID (0: the master) and pid, what it publishes is
+// noted in that slot and tagged with the pid
+inline int selfId = 0;
+inline pid_t selfPid;
+// For npstat, see metrics_segment.cpp
+inline MetricsSegment *metrics;
+
+inline MetricsSlot &ownMetrics() { return metrics->slot(selfId); }
+
+// A user pipe is a pipe(2), whose read end the writer passes to the
+// receiver's process with SCM_RIGHTS. pipeSockets[id] is a datagram
+// socketpair per user ID, made before the first fork like wakeFds: anyone
+// sends on [1], only user id receives on [0]. No file is involved and
+// neither side waits for the other.
+inline vector<array<int, 2>> pipeSockets;
+
+inline bool sendUserPipe(int receiver_id, int sender_id, int read_fd) {
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec iov = {.iov_base = &sender_id, .iov_len = sizeof(sender_id)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &read_fd, sizeof(int));
+    return sendmsg(pipeSockets[receiver_id][1], &msg, MSG_DONTWAIT) >= 0;
+}
+
+// Move the user pipes sent to user_id into user_pipe_fds (sender ID -> read
+// end). A negative user_id throws them away, for a slot changing hands.
+inline void receiveUserPipes(int user_id, map<int, int> &user_pipe_fds) {
+    int slot = user_id < 0 ? -user_id : user_id;
+    while (true) {
+        int sender_id;
+        char control[CMSG_SPACE(sizeof(int))];
+        iovec iov = {.iov_base = &sender_id, .iov_len = sizeof(sender_id)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(pipeSockets[slot][0], &msg,
+                    MSG_DONTWAIT | MSG_CMSG_CLOEXEC) < 0) {
+            return;
+        }
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int read_fd;
+        memcpy(&read_fd, CMSG_DATA(cmsg), sizeof(int));
+        if (user_id < 0) {
+            userList->slot(sender_id).bulkBytes -= BulkPipe::size(read_fd);
+            close(read_fd);
+            continue;
+        }
+        if (user_pipe_fds.count(sender_id)) {
+            close(user_pipe_fds[sender_id]);
+        }
+        user_pipe_fds[sender_id] = read_fd;
+    }
+}
+
+// Answer to `stats` and the master's SIGUSR1 dump
+inline string statsReport(UserDirectory *userList) {
+    string msg = serverStats->report();
+    msg += "<ID>\t<nickname>\t<bytes in>\t<bytes out>\n";
+    for (int idx = 1; idx <= userList->capacity(); idx++) {
+        UserRecord user = userList->read(idx);
+        if (user.isLogin) {
+            msg += to_string(idx) + "\t" + user.name + "\t" +
+                   to_string(userList->slot(idx).bytesIn) + "\t" +
+                   to_string(userList->slot(idx).bytesOut) + "\n";
+        }
+    }
+    return msg;
+}
+
 // Utility class, instance independent
 class ProcessExecutor {
   public:
@@ -69,14 +196,15 @@ class ProcessExecutor {
         int error_fd = STDERR_FILENO;
         bool userPipeFromErr = false;
         bool userPipeToErr = false;
+        bool userPipeOut = false; // output_fd is a user pipe, ours to close
+        int bulkTo = 0; // output_fd is a bulk pipe for this user, sent later
+        off_t bulkHeld = 0; // what the sender has in other bulk pipes
     };
     // static method bind on class
-    static bool run(const ProcessConfig &config, int user_id, sem_t *read_lock,
-                    sem_t *write_lock, array<int, 2> shared_pipe,
-                    UserInfo *userList) {
+    static bool run(const ProcessConfig &config, int user_id,
+                    UserDirectory *userList) {
         bool need_bash = true;
-        if (handleBuiltins(config, user_id, read_lock, write_lock, shared_pipe,
-                           userList, need_bash)) {
+        if (handleBuiltins(config, user_id, userList, need_bash)) {
             return need_bash;
         }
 
@@ -87,6 +215,9 @@ class ProcessExecutor {
             return true;
         }
 
+        if (config.bulkTo != 0) {
+            BulkPipe::limitWriter(config.bulkHeld);
+        }
         setupChildProcessIO(config);
         // In fact, child and parent choose one close the originally fd before
         // dup2 is fine, but close both side in case
@@ -95,29 +226,53 @@ class ProcessExecutor {
         return true;
     }
 
-    static void broadcastMessage(string msg, int user_id, sem_t *read_lock,
-                                 sem_t *write_lock, array<int, 2> shared_pipe) {
-        sem_wait(write_lock);
-        write(shared_pipe[1], &user_id, sizeof(user_id));
-        size_t size = msg.size();
-        write(shared_pipe[1], &size, sizeof(size));
-        write(shared_pipe[1], msg.c_str(), size);
-        sem_post(read_lock);
+    // Every process, the sender included, handles the message when it reads
+    // it from the ring
+    static void broadcastMessage(MessageType type, int user_id,
+                                 const string &name, const string &text = "") {
+        string msg = encodeMessage(type, user_id, name, text, 0, 0);
+        uint64_t start = monotonicNs();
+        UserSlot &self = userList->slot(selfId);
+        self.claimChannel = -1;
+        uint64_t seq = messageRing->publish(msg, selfPid, self.claim);
+        countMessage(start);
+        for (int id = 0; id <= userList->capacity(); id++) {
+            if (id != user_id) {
+                BroadcastRing::wake(userList->slot(id).sleeping, wakeFds[id]);
+            }
+        }
+        serverStats->internalMsgNs.record(monotonicNs() - start);
+        outbox.emplace_back(seq, move(msg));
+    }
+
+    // Only target reads the message, and only its process is woken
+    static void sendMessage(MessageType type, int user_id, const string &name,
+                            int target, const string &text = "") {
+        string msg = encodeMessage(type, user_id, name, text, target,
+                                   messageRing->end());
+        uint64_t start = monotonicNs();
+        UserSlot &self = userList->slot(selfId);
+        self.claimChannel = target;
+        mailboxes[target].publish(msg, selfPid, self.claim);
+        countMessage(start);
+        Mailbox::wake(userList->slot(target).sleeping, wakeFds[target]);
+        serverStats->internalMsgNs.record(monotonicNs() - start);
     }
 
   private:
+    static void countMessage(uint64_t publishStart) {
+        MetricsSlot &own = ownMetrics();
+        MetricsSegment::add(own.messagesSent);
+        MetricsSegment::add(own.waitNs, monotonicNs() - publishStart);
+    }
+
     // since run call these function, need static
     static bool handleBuiltins(const ProcessConfig &config, int user_id,
-                               sem_t *read_lock, sem_t *write_lock,
-                               array<int, 2> shared_pipe, UserInfo *userList,
-                               bool &need_bash) {
+                               UserDirectory *userList, bool &need_bash) {
         const string &cmd = config.arguments[0];
-        UserInfo *user = &userList[user_id];
+        UserRecord user = userList->read(user_id);
         if (cmd == "exit") {
-            string msg =
-                "exit *** User \'" + string(user->name) + "\' left. ***";
-            ProcessExecutor::broadcastMessage(msg, user_id, read_lock,
-                                              write_lock, shared_pipe);
+            ProcessExecutor::broadcastMessage(MSG_EXIT, user_id, user.name);
             // exit(0);
             need_bash = false;
             return true;
@@ -139,10 +294,11 @@ class ProcessExecutor {
 
         if (cmd == "who") {
             string msg = "<ID>\t<nickname>\t<IP:port>\t<indicate me>\n";
-            for (int idx = 1; idx <= MAXUSER; idx++) {
-                if (userList[idx].isLogin) {
-                    msg += to_string(userList[idx].id) + "\t" +
-                           userList[idx].name + "\t" + userList[idx].ipPort;
+            for (int idx = 1; idx <= userList->capacity(); idx++) {
+                UserRecord other = userList->read(idx);
+                if (other.isLogin) {
+                    msg += to_string(other.id) + "\t" + other.name + "\t" +
+                           other.ipPort;
                     if (idx == user_id) {
                         msg += "\t<-me";
                     }
@@ -154,66 +310,63 @@ class ProcessExecutor {
             return true;
         }
 
+        if (cmd == "stats") {
+            cout << statsReport(userList);
+            need_bash = true;
+            return true;
+        }
+
         if (cmd == "tell") {
             int recevier_id = stoi(config.arguments[1]);
             string msg = "";
-            if (!userList[recevier_id].isLogin) {
+            if (!userList->isLogin(recevier_id)) {
                 msg += "*** Error: user #" + to_string(recevier_id) +
                        " does not exist yet. ***\n";
                 need_bash = true;
                 cout << msg << flush;
             } else { // send message to target user
-                sem_wait(write_lock);
-                write(shared_pipe[1], &user_id, sizeof(user_id));
-                msg = "tell " + config.arguments[1] + " *** " + user->name +
-                      " told you ***: ";
                 for (int i = 2; i < config.arguments.size(); i++) {
                     msg += config.arguments[i];
                     if (i != config.arguments.size() - 1) {
                         msg += " ";
                     }
                 }
-                msg += "\n";
-                size_t size = msg.size();
-                write(shared_pipe[1], &size, sizeof(size));
-                write(shared_pipe[1], msg.c_str(), size);
-                sem_post(read_lock);
-                need_bash = false;
+                if (recevier_id == user_id) {
+                    cout << "*** " << user.name << " told you ***: " << msg
+                         << endl;
+                } else {
+                    ProcessExecutor::sendMessage(MSG_TELL, user_id, user.name,
+                                                 recevier_id, msg);
+                }
+                need_bash = true;
             }
             return true;
         }
 
         if (cmd == "yell") {
-            string msg = "yell *** " + string(user->name) + " yelled ***: ";
+            string msg;
             for (int i = 1; i < config.arguments.size(); i++) {
                 msg += config.arguments[i];
                 if (i != config.arguments.size() - 1) {
                     msg += " ";
                 }
             }
-            msg += "\n";
-            ProcessExecutor::broadcastMessage(msg, user_id, read_lock,
-                                              write_lock, shared_pipe);
+            ProcessExecutor::broadcastMessage(MSG_YELL, user_id, user.name,
+                                              msg);
             need_bash = false;
             return true;
         }
 
         if (cmd == "name") {
-            for (int idx = 1; idx <= MAXUSER; idx++) {
-                if (userList[idx].isLogin &&
-                    userList[idx].name == config.arguments[1]) {
-                    cout << "*** User '" << config.arguments[1]
-                         << "' already exists. ***" << endl;
-                    need_bash = true;
-                    return true;
-                }
+            if (!userList->rename(user_id, config.arguments[1])) {
+                cout << "*** User '" << config.arguments[1]
+                     << "' already exists. ***" << endl;
+                need_bash = true;
+                return true;
             }
-            strcpy(user->name, config.arguments[1].c_str());
-            string msg = "name " + string("*** User from ") +
-                         string(user->ipPort) + " is named \'" +
-                         config.arguments[1] + "\'. ***";
-            ProcessExecutor::broadcastMessage(msg, user_id, read_lock,
-                                              write_lock, shared_pipe);
+            user = userList->read(user_id); // the name as stored
+            ProcessExecutor::broadcastMessage(MSG_NAME, user_id, user.name,
+                                              user.ipPort);
             need_bash = false;
             return true;
         }
@@ -222,10 +375,16 @@ class ProcessExecutor {
 
     static pid_t createChildProcess() {
         pid_t pid;
+        uint64_t start = monotonicNs();
         while ((pid = fork()) == -1) {
             if (errno == EAGAIN) {
                 wait(nullptr);
             }
+            start = monotonicNs();
+        }
+        if (pid != 0) {
+            serverStats->forks++;
+            MetricsSegment::recordFork(ownMetrics(), monotonicNs() - start);
         }
         return pid;
     }
@@ -239,7 +398,9 @@ class ProcessExecutor {
         // get the fd file type
         fstat(config.output_fd, &fd_stat);
         // close file if fd_out isn't STDOUT_FILENO and is a regular file.
-        if (config.output_fd != STDOUT_FILENO && S_ISREG(fd_stat.st_mode)) {
+        // A bulk pipe is sent first, by the parser.
+        if (config.output_fd != STDOUT_FILENO && S_ISREG(fd_stat.st_mode) &&
+            !config.userPipeOut) {
             close(config.output_fd);
         }
     }
@@ -300,23 +461,17 @@ class CommandParser {
     stringstream input_stream;
     vector<string> current_args;
     PipeManager &pipe_manager;
-    sem_t *read_lock;
-    sem_t *write_lock;
-    array<int, 2> shared_pipe;
     int user_id;
-    UserInfo *userList;
-    map<int, pair<int, int>> &user_pipe_fds;
+    UserDirectory *userList;
+    map<int, int> &user_pipe_fds;
     string user_pipe_msg;
     string line_command;
 
   public:
     CommandParser(const string &line, PipeManager &pm, int user_id,
-                  sem_t *read_lock, sem_t *write_lock,
-                  array<int, 2> shared_pipe, UserInfo *userList,
-                  map<int, pair<int, int>> &user_pipe_fds)
+                  UserDirectory *userList, map<int, int> &user_pipe_fds)
         : input_stream(line), pipe_manager(pm), user_id(user_id),
-          read_lock(read_lock), write_lock(write_lock),
-          shared_pipe(shared_pipe), userList(userList),
+          userList(userList),
           user_pipe_fds(user_pipe_fds), line_command(line) {}
 
     bool processCommands() {
@@ -357,13 +512,18 @@ class CommandParser {
 
         if (!user_pipe_msg.empty()) {
             cout << user_pipe_msg << flush;
-            user_pipe_msg.insert(0, "user_pipe "s);
-            ProcessExecutor::broadcastMessage(user_pipe_msg, user_id, read_lock,
-                                              write_lock, shared_pipe);
+            ProcessExecutor::broadcastMessage(MSG_USER_PIPE, user_id,
+                                              userList->read(user_id).name,
+                                              user_pipe_msg);
         }
 
-        bool need_bash = ProcessExecutor::run(
-            config, user_id, read_lock, write_lock, shared_pipe, userList);
+        bool need_bash = ProcessExecutor::run(config, user_id, userList);
+        if (config.bulkTo != 0) { // the writer is done
+            sendBulkPipe(config.bulkTo, config.output_fd, config.bulkHeld);
+        }
+        if (config.userPipeOut) {
+            close(config.output_fd); // the command has its own copy
+        }
         // Here is mid of command, so only shift when "|n" or "!n". ">" doesn't
         // enter here
         if (operator_token != "|") {
@@ -432,14 +592,31 @@ class CommandParser {
                                 O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0664);
     }
 
+    // A bulk pipe, or a pipe(2) whose read end is on its way to the
+    // receiver. False with nothing left open when that fails.
+    bool openUserPipe(bool bulk, int receiver_id, int pipe_fds[2]) {
+        if (bulk) {
+            return (pipe_fds[1] = BulkPipe::create()) >= 0;
+        }
+        if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            return false;
+        }
+        if (!sendUserPipe(receiver_id, user_id, pipe_fds[0])) {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            return false;
+        }
+        return true;
+    }
+
     void handleOutUserPipe(const string &op,
                            ProcessExecutor::ProcessConfig &config) {
         int sender_id = user_id;
         int receiver_id = stoi(op.substr(1));
-        UserInfo *user = &userList[sender_id];
+        UserRecord user = userList->read(sender_id);
+        UserRecord receiver = userList->read(receiver_id);
         // recv user not exist
-        if (receiver_id < 0 || receiver_id > 30 ||
-            !userList[receiver_id].isLogin) {
+        if (!receiver.isLogin) {
             config.userPipeToErr = true;
             string msg = "*** Error: user #" + to_string(receiver_id) +
                          " does not exist yet. ***\n";
@@ -447,34 +624,36 @@ class CommandParser {
             cout << msg << flush;
             return;
         }
-        string user_pipe_filename =
-            "user_pipe/" + to_string(receiver_id) + "_" + to_string(sender_id);
-        if (mkfifo(user_pipe_filename.c_str(), PERMS) <
-            0) { // user pipe already exists
+        atomic<bool> &pending = userList->pipeFrom(receiver_id, sender_id);
+        int pipe_fds[2];
+        bool bulk = BulkPipe::enabled();
+        if (pending.exchange(true)) { // user pipe already exists
             config.userPipeToErr = true;
             string msg = "*** Error: the pipe #" + to_string(sender_id) +
                          "->#" + to_string(receiver_id) +
                          " already exists. ***\n";
             setupInputPipe(config);
             cout << msg << flush;
+        } else if (!openUserPipe(bulk, receiver_id, pipe_fds)) {
+            pending = false;
+            config.userPipeToErr = true;
+            setupInputPipe(config);
+            cout << "Error: failed to create user pipe" << endl;
         } else {
-            string msg = "> " + to_string(receiver_id);
-            ProcessExecutor::broadcastMessage(msg, user_id, read_lock,
-                                              write_lock, shared_pipe);
-            int output_fd = open(user_pipe_filename.c_str(), O_WRONLY);
-            if (output_fd < 0) {
-                cout << "Error: failed to open writefd for user pipe" << endl
-                     << flush;
+            if (bulk) {
+                config.bulkTo = receiver_id;
+                config.bulkHeld = userList->slot(user_id).bulkBytes;
+            } else {
+                close(pipe_fds[0]); // in flight to the receiver
             }
             // no need for err_fd redirect, won't occur in user pipe
-            config.output_fd = output_fd;
-            // map<int, pair<int, int>> would auto insert (0, output_fd), or update (exist, output_fd)
-            user_pipe_fds[receiver_id].second = output_fd;
-            // Put pipe_fd to pipe[1], for removeNonNecessaryPipes to close
-            msg = "*** " + string(user->name) + " (#" + to_string(user_id) +
-                  ") just piped \'" + line_command + "\' to " +
-                  userList[receiver_id].name + " (#" + to_string(receiver_id) +
-                  ") ***\n";
+            config.output_fd = pipe_fds[1];
+            config.userPipeOut = true;
+            MetricsSegment::add(ownMetrics().pipesOut);
+            string msg = "*** " + string(user.name) + " (#" +
+                         to_string(user_id) + ") just piped \'" +
+                         line_command + "\' to " + receiver.name + " (#" +
+                         to_string(receiver_id) + ") ***\n";
             user_pipe_msg.append(msg);
         }
     }
@@ -483,10 +662,9 @@ class CommandParser {
                           ProcessExecutor::ProcessConfig &config) {
         int sender_id = stoi(op.substr(1));
         int receiver_id = user_id;
-        UserInfo *user = &userList[user_id];
-        // sender not exist
-        if (sender_id < 0 || sender_id > 30 ||
-            !userList[sender_id].isLogin) { // the source user does not exist
+        UserRecord user = userList->read(user_id);
+        UserRecord sender = userList->read(sender_id);
+        if (!sender.isLogin) { // the source user does not exist
             config.userPipeFromErr = true;
             string msg = "*** Error: user #" + to_string(sender_id) +
                          " does not exist yet. ***\n";
@@ -494,22 +672,22 @@ class CommandParser {
             cout << msg << flush;
             return;
         }
-        if (user_pipe_fds.count(sender_id) &&
-            user_pipe_fds[sender_id].first != 0) {
-            config.pipe[0] = user_pipe_fds[sender_id].first;
-            user_pipe_fds[sender_id].first = 0;
-            string user_pipe_filename = "user_pipe/" + to_string(receiver_id) +
-                                        "_" + to_string(sender_id);
-            if (unlink(user_pipe_filename.c_str()) < 0) {
-                cerr << "Error: failed to unlink user pipe" << endl;
-            }
-            string msg = "< " + to_string(sender_id);
-            ProcessExecutor::broadcastMessage(msg, user_id, read_lock,
-                                              write_lock, shared_pipe);
-            msg = "*** " + string(user->name) + " (#" + to_string(receiver_id) +
-                  ") just received from " + string(userList[sender_id].name) +
-                  " (#" + to_string(sender_id) + ") by \'" + line_command +
-                  "\' ***\n";
+        // this process writes the pipe itself, or has this line's own bulk
+        // pipe still to send: waiting could only deadlock
+        bool may_wait = sender_id != user_id && config.bulkTo == 0;
+        if (awaitUserPipe(sender_id, may_wait)) {
+            config.pipe[0] = user_pipe_fds[sender_id];
+            user_pipe_fds.erase(sender_id);
+            userList->pipeFrom(user_id, sender_id) = false;
+            off_t bytes = BulkPipe::size(config.pipe[0]);
+            userList->slot(sender_id).bulkBytes -= bytes;
+            MetricsSegment::add(ownMetrics().pipesIn);
+            MetricsSegment::add(ownMetrics().pipeBytesIn, bytes);
+            string msg = "*** " + string(user.name) + " (#" +
+                         to_string(receiver_id) + ") just received from " +
+                         string(sender.name) + " (#" +
+                         to_string(sender_id) + ") by \'" + line_command +
+                         "\' ***\n";
             if (user_pipe_msg.empty()) {
                 user_pipe_msg.append(msg);
             } else {
@@ -525,6 +703,60 @@ class CommandParser {
         }
     }
 
+    // Sealed once its writer is done, then it goes to the receiver. One
+    // that went over the room the writer had (held_before is what the
+    // sender held then) is dropped, and both users are told.
+    void sendBulkPipe(int receiver_id, int fd, off_t held_before) {
+        atomic<int64_t> &held = userList->slot(user_id).bulkBytes;
+        off_t bytes = BulkPipe::seal(fd);
+        if (BulkPipe::overrun(bytes, held_before)) {
+            string msg = BulkPipe::overrunMessage(user_id, receiver_id);
+            cout << msg << flush;
+            // still set: the receiver is the one we piped to, waiting or not
+            if (userList->pipeFrom(receiver_id, user_id).exchange(false) &&
+                receiver_id != user_id) {
+                ProcessExecutor::sendMessage(MSG_USER_PIPE, user_id,
+                                             userList->read(user_id).name,
+                                             receiver_id, msg);
+            }
+            return;
+        }
+        held += bytes;
+        // the receiver may have left meanwhile, that clears the flag
+        if (!userList->pipeFrom(receiver_id, user_id) ||
+            !sendUserPipe(receiver_id, user_id, fd)) {
+            held -= bytes;
+            userList->pipeFrom(receiver_id, user_id) = false;
+        } else {
+            MetricsSegment::add(ownMetrics().pipeBytesOut, bytes);
+        }
+    }
+
+    // The pipe from sender_id into user_pipe_fds. A bulk pipe arrives once
+    // its writer is done, wait for it (if may_wait) while the sender has it
+    // announced and the client is still there.
+    bool awaitUserPipe(int sender_id, bool may_wait) {
+        while (true) {
+            receiveUserPipes(user_id, user_pipe_fds);
+            if (user_pipe_fds.count(sender_id)) {
+                return true;
+            }
+            if (!may_wait || !userList->pipeFrom(user_id, sender_id) ||
+                !userList->isLogin(sender_id)) {
+                return false;
+            }
+            pollfd pfds[2] = {
+                {.fd = pipeSockets[user_id][0], .events = POLLIN, .revents = 0},
+                {.fd = STDIN_FILENO, .events = POLLRDHUP, .revents = 0}};
+            uint64_t start = monotonicNs();
+            poll(pfds, 2, 100);
+            MetricsSegment::add(ownMetrics().waitNs, monotonicNs() - start);
+            if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+                return false; // the client is gone, the main loop logs out
+            }
+        }
+    }
+
     void handlePiping(const string &op,
                       ProcessExecutor::ProcessConfig &config) {
         int pipe_id = op.size() > 1 ? stoi(op.substr(1)) : 0;
@@ -550,8 +782,7 @@ class CommandParser {
             config.arguments = current_args;
             setupInputPipe(config);
 
-            need_bash = ProcessExecutor::run(config, user_id, read_lock,
-                                             write_lock, shared_pipe, userList);
+            need_bash = ProcessExecutor::run(config, user_id, userList);
             // Command in here is definitely one command(ex: number, removetag,
             // impossible |n & !n)
             pipe_manager.shiftPipeNumbers();
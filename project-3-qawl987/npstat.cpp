@@ -0,0 +1,249 @@
+#include "../project-2-qawl987/server_stats.cpp"
+#include "metrics_segment.cpp"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+// Live view of a running np_multi_proc, top style: maps its metrics
+// segment read-only (see metrics_segment.cpp) and prints the rates of the
+// master and of every user process over each interval, busiest first.
+// Nothing is asked of the server, it never notices the reader.
+// Usage: npstat [--interval SEC] [--count N] [SHM_NAME]
+//
+// fork_us is the mean time in fork(), p99_us the bucket the 99th
+// percentile falls in. bulk KB/s only counts bulk user pipes (np_multi_proc
+// --bulk-pipes), the shell never sees what goes through a pipe(2). wait% is
+// the share of the interval spent publishing messages and waiting for bulk
+// pipe writers, summed over the processes in the "all" row.
+
+struct Sample {
+    uint32_t session;
+    int32_t pid;
+    uint64_t commands, forks, forkNs, pipesOut, pipesIn, pipeBytesOut,
+        pipeBytesIn, messagesSent, messagesReceived, waitNs;
+    uint64_t forkUs[METRICS_FORK_BUCKETS];
+};
+
+struct Rates {
+    int id; // -1 for the total
+    int32_t pid;
+    double commands, forks, pipesOut, pipesIn, bulkOut, bulkIn, sent,
+        received, waitShare;
+    double forkUs;   // mean
+    uint64_t forkP99; // upper bound of the bucket, microseconds
+};
+
+Sample take(const MetricsSlot &s) {
+    Sample out;
+    out.session = s.session.load(memory_order_relaxed);
+    out.pid = s.pid.load(memory_order_acquire);
+    out.commands = s.commands.load(memory_order_relaxed);
+    out.forks = s.forks.load(memory_order_relaxed);
+    out.forkNs = s.forkNs.load(memory_order_relaxed);
+    out.pipesOut = s.pipesOut.load(memory_order_relaxed);
+    out.pipesIn = s.pipesIn.load(memory_order_relaxed);
+    out.pipeBytesOut = s.pipeBytesOut.load(memory_order_relaxed);
+    out.pipeBytesIn = s.pipeBytesIn.load(memory_order_relaxed);
+    out.messagesSent = s.messagesSent.load(memory_order_relaxed);
+    out.messagesReceived = s.messagesReceived.load(memory_order_relaxed);
+    out.waitNs = s.waitNs.load(memory_order_relaxed);
+    for (int b = 0; b < METRICS_FORK_BUCKETS; b++) {
+        out.forkUs[b] = s.forkUs[b].load(memory_order_relaxed);
+    }
+    return out;
+}
+
+// What happened between before and after. A slot taken over meanwhile
+// started again from zero.
+Sample delta(const Sample &before, const Sample &after) {
+    if (before.session != after.session) {
+        return after;
+    }
+    Sample d = after;
+    d.commands -= before.commands;
+    d.forks -= before.forks;
+    d.forkNs -= before.forkNs;
+    d.pipesOut -= before.pipesOut;
+    d.pipesIn -= before.pipesIn;
+    d.pipeBytesOut -= before.pipeBytesOut;
+    d.pipeBytesIn -= before.pipeBytesIn;
+    d.messagesSent -= before.messagesSent;
+    d.messagesReceived -= before.messagesReceived;
+    d.waitNs -= before.waitNs;
+    for (int b = 0; b < METRICS_FORK_BUCKETS; b++) {
+        d.forkUs[b] -= before.forkUs[b];
+    }
+    return d;
+}
+
+void accumulate(Sample &total, const Sample &d) {
+    total.commands += d.commands;
+    total.forks += d.forks;
+    total.forkNs += d.forkNs;
+    total.pipesOut += d.pipesOut;
+    total.pipesIn += d.pipesIn;
+    total.pipeBytesOut += d.pipeBytesOut;
+    total.pipeBytesIn += d.pipeBytesIn;
+    total.messagesSent += d.messagesSent;
+    total.messagesReceived += d.messagesReceived;
+    total.waitNs += d.waitNs;
+    for (int b = 0; b < METRICS_FORK_BUCKETS; b++) {
+        total.forkUs[b] += d.forkUs[b];
+    }
+}
+
+Rates rates(int id, const Sample &d, double secs) {
+    Rates r = {};
+    r.id = id;
+    r.pid = d.pid;
+    r.commands = d.commands / secs;
+    r.forks = d.forks / secs;
+    r.pipesOut = d.pipesOut / secs;
+    r.pipesIn = d.pipesIn / secs;
+    r.bulkOut = d.pipeBytesOut / 1024.0 / secs;
+    r.bulkIn = d.pipeBytesIn / 1024.0 / secs;
+    r.sent = d.messagesSent / secs;
+    r.received = d.messagesReceived / secs;
+    r.waitShare = d.waitNs / 1e7 / secs;
+    r.forkUs = d.forks ? d.forkNs / 1000.0 / d.forks : 0;
+    uint64_t rank = d.forks - d.forks / 100, seen = 0;
+    for (int b = 0; b < METRICS_FORK_BUCKETS && d.forks; b++) {
+        seen += d.forkUs[b];
+        if (seen >= rank) {
+            r.forkP99 = 1ull << b;
+            break;
+        }
+    }
+    return r;
+}
+
+void printRow(const Rates &r) {
+    char id[16];
+    if (r.id < 0) {
+        snprintf(id, sizeof(id), "all");
+    } else if (r.id == 0) {
+        snprintf(id, sizeof(id), "master");
+    } else {
+        snprintf(id, sizeof(id), "%d", r.id);
+    }
+    printf("%-6s %7d %7.1f %6.1f %7.0f %6lu %6.1f %6.1f %8.1f %8.1f %6.1f "
+           "%6.1f %5.1f\n",
+           id, r.pid, r.commands, r.forks, r.forkUs,
+           (unsigned long)r.forkP99, r.pipesOut, r.pipesIn, r.bulkOut,
+           r.bulkIn, r.sent, r.received, r.waitShare);
+}
+
+bool alive(pid_t pid) { return kill(pid, 0) == 0 || errno == EPERM; }
+
+int main(int argc, char *argv[]) {
+    double interval = 1;
+    long count = 0; // 0: until the server goes
+    static const option longOptions[] = {
+        {"interval", required_argument, nullptr, 'i'},
+        {"count", required_argument, nullptr, 'n'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:n:", longOptions, nullptr)) !=
+           -1) {
+        if (opt == 'i' && (interval = atof(optarg)) > 0) {
+            continue;
+        }
+        if (opt == 'n' && (count = atol(optarg)) >= 0) {
+            continue;
+        }
+        fprintf(stderr,
+                "Usage: %s [--interval SEC] [--count N] [SHM_NAME]\n",
+                argv[0]);
+        return 1;
+    }
+    const char *name = optind < argc ? argv[optind] : METRICS_SHM_NAME;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(name);
+        return 1;
+    }
+    void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    const MetricsSegment *seg =
+        mem == MAP_FAILED ? nullptr : MetricsSegment::open(mem, st.st_size);
+    if (seg == nullptr) {
+        fprintf(stderr, "%s: not an np_multi_proc metrics segment of "
+                        "version %d\n",
+                name, METRICS_VERSION);
+        return 1;
+    }
+
+    bool tty = isatty(STDOUT_FILENO);
+    vector<Sample> last(seg->capacity + 1);
+    for (int id = 0; id <= seg->capacity; id++) {
+        last[id] = take(seg->slot(id));
+    }
+    uint64_t lastNs = monotonicNs();
+    for (long round = 1; count == 0 || round <= count; round++) {
+        usleep((useconds_t)(interval * 1e6));
+        if (!alive(seg->serverPid)) {
+            fprintf(stderr, "np_multi_proc (pid %d) is gone\n",
+                    seg->serverPid);
+            return 1;
+        }
+        uint64_t now = monotonicNs();
+        double secs = (now - lastNs) / 1e9;
+        lastNs = now;
+
+        Sample total = {};
+        Rates master = {};
+        vector<Rates> users;
+        for (int id = 0; id <= seg->capacity; id++) {
+            Sample current = take(seg->slot(id));
+            Sample d = delta(last[id], current);
+            last[id] = current;
+            if (current.pid == 0 && d.commands == 0) {
+                continue; // free, and nobody left it during the interval
+            }
+            accumulate(total, d);
+            if (id == 0) {
+                master = rates(id, d, secs);
+            } else {
+                users.push_back(rates(id, d, secs));
+            }
+        }
+        stable_sort(users.begin(), users.end(),
+                    [](const Rates &a, const Rates &b) {
+                        return a.commands > b.commands;
+                    });
+        total.pid = seg->serverPid;
+
+        if (tty) {
+            printf("\033[H\033[2J");
+        } else if (round > 1) {
+            printf("\n");
+        }
+        printf("np_multi_proc pid %d, up %.0f s, %zu of %d users, "
+               "interval %.1f s\n",
+               seg->serverPid, (now - seg->startNs) / 1e9, users.size(),
+               seg->capacity, secs);
+        printf("%-6s %7s %7s %6s %7s %6s %6s %6s %8s %8s %6s %6s %5s\n", "ID",
+               "PID", "cmd/s", "fork/s", "fork_us", "p99_us", "pipe>", "pipe<",
+               "bulk>KB", "bulk<KB", "msg>", "msg<", "wait%");
+        printRow(rates(-1, total, secs));
+        printRow(master);
+        for (const Rates &r : users) {
+            printRow(r);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,350 @@
+#include <atomic>
+#include <errno.h>
+#include <new>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+// np_multi_proc's user list, in shared memory and sized at startup. Every
+// slot is a seqlock: a writer makes seq odd, changes the record and makes
+// seq even again, a reader copies the record and retries when seq moved.
+// So `who` and the user pipe checks never block and never see half a
+// rename. Writers (login, logout, rename) are rare and take a spinlock,
+// under which they keep a hash index of the names: `name` checks
+// uniqueness with one probe instead of a scan. Slots are cache line
+// aligned, a process updating its counters doesn't slow down the readers
+// of its neighbours.
+//
+// The lock holds the writer's pid. Whoever waits on a writer that was
+// killed takes the lock over and repairs what it left, like a robust
+// mutex; the master does the same as soon as it sees the process go.
+#define USER_NAME_SIZE 32
+#define USER_ADDR_SIZE 48
+#define DEFAULT_USER_NAME "(no name)"
+
+inline bool processAlive(pid_t pid) {
+    return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+struct UserRecord {
+    bool isLogin;
+    int id; // range from 1 to capacity
+    char name[USER_NAME_SIZE];
+    char ipPort[USER_ADDR_SIZE];
+};
+
+struct alignas(64) UserSlot {
+    std::atomic<uint32_t> seq; // odd while the record is written
+    UserRecord record;
+    // set by the user process before it blocks, see message_ring.cpp
+    alignas(64) std::atomic<uint32_t> sleeping;
+    // socket byte counters, refreshed by the user process after each poll
+    alignas(64) std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    // The message the process is publishing, for the master to finish if it
+    // dies: see MessageRing::publish(). channel is -1 for the broadcast
+    // ring, else the mailbox's user ID.
+    std::atomic<uint64_t> claim;
+    std::atomic<int32_t> claimChannel;
+    std::atomic<int32_t> pid; // of the user process, set by the master
+    // in bulk user pipes this user sent and nobody read yet, see
+    // bulk_pipe.cpp
+    std::atomic<int64_t> bulkBytes;
+};
+
+class UserDirectory {
+  public:
+    // Shared memory needed for capacity users
+    static size_t bytes(int capacity) { return Layout(capacity).end; }
+
+    // Build a directory in zeroed memory of bytes(capacity)
+    static UserDirectory *create(void *mem, int capacity) {
+        UserDirectory *dir = new (mem) UserDirectory(capacity);
+        for (int id = 1; id <= capacity; id++) {
+            dir->reset(dir->slot(id).record);
+        }
+        return dir;
+    }
+
+    int capacity() const { return layout.users; }
+
+    // Consistent copy of user id's record, an empty one for an unknown id
+    UserRecord read(int id) const {
+        UserRecord copy = {};
+        if (id < 1 || id > capacity()) {
+            return copy;
+        }
+        const UserSlot &s = slot(id);
+        for (unsigned spins = 1;; spins++) {
+            uint32_t before = s.seq.load(std::memory_order_acquire);
+            if (before & 1) { // a writer is in the middle of it
+                pid_t owner = writeLock.load();
+                if (spins % 1024 == 0 && !processAlive(owner)) {
+                    const_cast<UserDirectory *>(this)->recover(owner);
+                }
+                sched_yield();
+                continue;
+            }
+            memcpy(&copy, &s.record, sizeof(copy));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) == before) {
+                return copy;
+            }
+        }
+    }
+
+    bool isLogin(int id) const { return read(id).isLogin; }
+
+    // Lowest free ID, 0 when all are taken. Only the master logs users in,
+    // so it stays free until login().
+    int freeSlot() const {
+        for (int id = 1; id <= capacity(); id++) {
+            if (!slot(id).record.isLogin) {
+                return id;
+            }
+        }
+        return 0;
+    }
+
+    void login(int id, const std::string &ipPort) {
+        WriteLock lock(this);
+        for (int sender = 0; sender <= capacity(); sender++) {
+            pipeFrom(id, sender) = false;
+        }
+        slot(id).bytesIn = 0;
+        slot(id).bytesOut = 0;
+        slot(id).claim = 0;
+        slot(id).bulkBytes = 0;
+        write(id, [&](UserRecord &r) {
+            r.isLogin = true;
+            r.id = id;
+            snprintf(r.ipPort, sizeof(r.ipPort), "%s", ipPort.c_str());
+        });
+        index(id);
+    }
+
+    void logout(int id) {
+        WriteLock lock(this);
+        if (!slot(id).record.isLogin) {
+            return;
+        }
+        unindex(id);
+        write(id, [&](UserRecord &r) { reset(r); });
+        for (int sender = 0; sender <= capacity(); sender++) {
+            pipeFrom(id, sender) = false;
+        }
+    }
+
+    // False when a user has the name already, id included. Longer names
+    // are cut.
+    bool rename(int id, const std::string &name) {
+        WriteLock lock(this);
+        char wanted[USER_NAME_SIZE];
+        snprintf(wanted, sizeof(wanted), "%s", name.c_str());
+        if (strcmp(wanted, DEFAULT_USER_NAME) == 0 ? defaultNamed > 0
+                                                    : find(wanted) != 0) {
+            return false;
+        }
+        unindex(id);
+        write(id, [&](UserRecord &r) {
+            memcpy(r.name, wanted, sizeof(wanted));
+        });
+        index(id);
+        return true;
+    }
+
+    // pipeFrom(receiver, sender): sender has a user pipe to receiver that
+    // receiver did not read yet. Set by the writer, cleared by the reader.
+    std::atomic<bool> &pipeFrom(int receiver, int sender) {
+        std::atomic<bool> *table =
+            (std::atomic<bool> *)((char *)this + layout.pipes);
+        return table[receiver * (capacity() + 1) + sender];
+    }
+
+    // Writer owner died: if it still holds the lock, take it over, make the
+    // record it was writing consistent again and rebuild the name index.
+    // The master calls this when it sees a user process go, waiters when
+    // the holder looks dead to them.
+    void recover(pid_t owner) {
+        if (owner > 0 && writeLock.compare_exchange_strong(owner, getpid())) {
+            repair();
+            writeLock.store(0, std::memory_order_release);
+        }
+    }
+
+    // Slot 0 is the master's, for its sleeping flag and its claims
+    UserSlot &slot(int id) {
+        return ((UserSlot *)((char *)this + layout.slots))[id];
+    }
+    const UserSlot &slot(int id) const {
+        return ((const UserSlot *)((const char *)this + layout.slots))[id];
+    }
+
+  private:
+    // Where the parts sit behind this header, in the same mapping
+    struct Layout {
+        int users;
+        unsigned indexSize; // power of two, at least twice the users
+        size_t slots, index, pipes, end;
+
+        explicit Layout(int capacity) : users(capacity), indexSize(1) {
+            while (indexSize < 2u * (capacity + 1)) {
+                indexSize *= 2;
+            }
+            slots = (sizeof(UserDirectory) + 63) / 64 * 64;
+            index = slots + sizeof(UserSlot) * (capacity + 1);
+            pipes = index + sizeof(int32_t) * indexSize;
+            end = pipes + sizeof(std::atomic<bool>) * (capacity + 1) *
+                              (capacity + 1);
+        }
+    };
+
+    struct WriteLock {
+        UserDirectory *dir;
+        explicit WriteLock(UserDirectory *dir) : dir(dir) {
+            pid_t me = getpid();
+            for (unsigned spins = 1;; spins++) {
+                int32_t owner = 0;
+                if (dir->writeLock.compare_exchange_weak(
+                        owner, me, std::memory_order_acquire)) {
+                    return;
+                }
+                if (spins % 1024 == 0 && !processAlive(owner) &&
+                    dir->writeLock.compare_exchange_strong(owner, me)) {
+                    dir->repair(); // ours now, as the dead owner left it
+                    return;
+                }
+                sched_yield();
+            }
+        }
+        ~WriteLock() { dir->writeLock.store(0, std::memory_order_release); }
+    };
+
+    const Layout layout;
+    std::atomic<int32_t> writeLock{0}; // pid of the writer, 0 when free
+    int writing = 0;                   // slot the writer changes
+    int defaultNamed = 0; // users named DEFAULT_USER_NAME, not indexed
+    int indexed = 0;      // name index entries in use
+    int removed = 0;      // and removed ones, probes walk over them
+
+    explicit UserDirectory(int capacity) : layout(capacity) {}
+
+    template <typename F> void write(int id, F change) {
+        writing = id;
+        UserSlot &s = slot(id);
+        s.seq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        change(s.record);
+        s.seq.fetch_add(1, std::memory_order_release);
+    }
+
+    // A writer died with the lock, which is ours now. End the write it was
+    // in with the strings terminated (that user is logged out next anyway)
+    // and rebuild the index it may have been changing.
+    void repair() {
+        UserSlot &s = slot(writing);
+        if (s.seq.load() & 1) {
+            s.record.name[USER_NAME_SIZE - 1] = '\0';
+            s.record.ipPort[USER_ADDR_SIZE - 1] = '\0';
+            s.seq.fetch_add(1, std::memory_order_release);
+        }
+        rebuildIndex();
+    }
+
+    void reset(UserRecord &r) {
+        r.isLogin = false;
+        r.id = 0;
+        snprintf(r.name, sizeof(r.name), "%s", DEFAULT_USER_NAME);
+        r.ipPort[0] = '\0';
+    }
+
+    // The name index, only touched under the write lock. Entries are user
+    // IDs, 0 for empty and -1 for removed. Renames leave removed entries
+    // behind, the index is rebuilt before they make probes long.
+    int32_t *nameIndex() { return (int32_t *)((char *)this + layout.index); }
+
+    static uint32_t hash(const char *name) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (; *name; name++) {
+            h = (h ^ (uint8_t)*name) * 16777619u;
+        }
+        return h;
+    }
+
+    int find(const char *name) {
+        unsigned mask = layout.indexSize - 1;
+        int32_t *table = nameIndex();
+        unsigned i = hash(name) & mask;
+        for (unsigned n = 0; n <= mask && table[i] != 0; n++) {
+            if (table[i] > 0 &&
+                strcmp(slot(table[i]).record.name, name) == 0) {
+                return table[i];
+            }
+            i = (i + 1) & mask;
+        }
+        return 0;
+    }
+
+    void index(int id) {
+        if (strcmp(slot(id).record.name, DEFAULT_USER_NAME) == 0) {
+            defaultNamed++;
+        } else if ((indexed + removed + 1) * 4u > layout.indexSize * 3) {
+            rebuildIndex(); // id included, it is listed already
+        } else {
+            insert(id);
+        }
+    }
+
+    void insert(int id) {
+        unsigned mask = layout.indexSize - 1;
+        int32_t *table = nameIndex();
+        unsigned i = hash(slot(id).record.name) & mask;
+        while (table[i] > 0) {
+            i = (i + 1) & mask;
+        }
+        removed -= table[i] < 0;
+        indexed++;
+        table[i] = id;
+    }
+
+    void rebuildIndex() {
+        memset(nameIndex(), 0, sizeof(int32_t) * layout.indexSize);
+        indexed = removed = defaultNamed = 0;
+        for (int id = 1; id <= capacity(); id++) {
+            const UserRecord &r = slot(id).record;
+            if (!r.isLogin) {
+                continue;
+            }
+            if (strcmp(r.name, DEFAULT_USER_NAME) == 0) {
+                defaultNamed++;
+            } else {
+                insert(id);
+            }
+        }
+    }
+
+    void unindex(int id) {
+        const char *name = slot(id).record.name;
+        if (strcmp(name, DEFAULT_USER_NAME) == 0) {
+            defaultNamed--;
+            return;
+        }
+        unsigned mask = layout.indexSize - 1;
+        int32_t *table = nameIndex();
+        unsigned i = hash(name) & mask;
+        for (unsigned n = 0; n <= mask && table[i] != 0; n++) {
+            if (table[i] == id) {
+                table[i] = -1;
+                indexed--;
+                removed++;
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+    }
+};
@@ -11,7 +11,8 @@
 #include <utility>
 #include <vector>
 
-using boost::asio::ip::tcp;
+#include "prompt_client.cpp"
+
 namespace beast = boost::beast;
 namespace http = beast::http;
 
@@ -23,6 +24,26 @@ struct ServerInfo {
 
 std::vector<ServerInfo> servers_info;
 
+// Forms encode the '/' and '@' of unix socket hosts as %2F and %40
+std::string url_decode(const std::string &value) {
+    std::string out;
+    for (std::size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '%' && i + 2 < value.size() &&
+            isxdigit(value[i + 1]) && isxdigit(value[i + 2])) {
+            out += (char)std::stoi(value.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            out += value[i] == '+' ? ' ' : value[i];
+        }
+    }
+    return out;
+}
+
+// A host naming a --unix listener ('/path' or '@name') needs no port
+bool is_local_socket(const std::string &host) {
+    return !host.empty() && (host[0] == '/' || host[0] == '@');
+}
+
 void parse_query() {
     std::stringstream ss(getenv("QUERY_STRING"));
     std::map<std::string, std::string> kv_pairs;
@@ -40,11 +61,12 @@ void parse_query() {
         std::string p_key = "p" + std::to_string(i);
         std::string f_key = "f" + std::to_string(i);
 
-        std::string host = kv_pairs[h_key];
+        std::string host = url_decode(kv_pairs[h_key]);
         std::string port = kv_pairs[p_key];
         std::string file = kv_pairs[f_key];
 
-        if (!host.empty() && !port.empty() && !file.empty()) {
+        if (!host.empty() && (!port.empty() || is_local_socket(host)) &&
+            !file.empty()) {
             servers_info.push_back(ServerInfo{host, port, file});
         }
     }
@@ -151,7 +173,8 @@ void print_predefined_msg() {
 
     // Table headers
     for (const auto &s : servers_info) {
-        std::cout << "          <th scope=\"col\">" << s.host << ":" << s.port
+        std::cout << "          <th scope=\"col\">" << HtmlEscape(s.host)
+                  << (is_local_socket(s.host) ? "" : ":" + s.port)
                   << "</th>\n";
     }
 
@@ -175,76 +198,41 @@ void print_predefined_msg() {
     )";
 }
 
-class TcpClient : public std::enable_shared_from_this<TcpClient> {
+class TcpClient : public PromptClient {
   public:
     TcpClient(boost::asio::io_context &io_context, int column_number)
-        : resolver_(io_context), socket_(io_context),
-          column_number(column_number) {}
+        : PromptClient(io_context), column_number(column_number) {}
 
     void async_connect(ServerInfo server_info) {
-        auto self = shared_from_this();
-        resolver_.async_resolve(
-            server_info.host, server_info.port,
-            [self, server_info](beast::error_code,
-                                const tcp::resolver::iterator &it) {
-                self->socket_.async_connect(
-                    it->endpoint(), [self, server_info](beast::error_code) {
-                        self->ip_port_ =
-                            server_info.host + ':' + server_info.port;
-                        self->file_.open("test_case/" + server_info.file_path,
-                                         std::fstream::in);
-                        self->async_read();
-                    });
-            });
+        file_path_ = server_info.file_path;
+        PromptClient::async_connect(server_info.host, server_info.port);
     }
 
   private:
     int column_number;
-    tcp::resolver resolver_;
-    tcp::socket socket_;
-    std::string ip_port_;
+    std::string file_path_;
     std::fstream file_;
-    http::request<http::dynamic_body> request_;
-    boost::asio::streambuf streambuf_;
 
-    void async_read() {
-        auto self(shared_from_this());
-        boost::asio::async_read(socket_, streambuf_,
-                                boost::asio::transfer_at_least(1),
-                                [self](beast::error_code, std::size_t) {
-                                    self->process_response();
-                                });
+    std::string session() const { return "s" + std::to_string(column_number); }
+
+    void on_connected() override {
+        file_.open("test_case/" + file_path_, std::fstream::in);
     }
 
-    void process_response() {
-        std::istream input(&streambuf_);
-        std::stringstream ss;
-        ss << input.rdbuf() << std::flush;
+    void on_output(const std::string &chunk) override {
+        output_shell(session(), chunk);
+    }
 
-        std::string session = "s" + std::to_string(column_number);
-        output_shell(session, ss.str());
-        if (ss.str().find('%') == std::string::npos) {
-            async_read();
-            return;
+    bool next_command(std::string &cmd) override {
+        if (!std::getline(file_, cmd)) {
+            return false;
         }
-
-        std::string cmd;
-        std::getline(file_, cmd);
-        if (cmd.back() == '\r') {
+        if (!cmd.empty() && cmd.back() == '\r') {
             cmd.pop_back();
         }
         cmd.append(1, '\n');
-        output_command(session, cmd);
-
-        auto self = shared_from_this();
-        boost::asio::async_write(socket_, boost::asio::buffer(cmd),
-                                 [self, cmd](beast::error_code, std::size_t) {
-                                     if (cmd == "exit\n") {
-                                         self->socket_.close();
-                                     } else {
-                                         self->async_read();
-                                     }
-                                 });
+        output_command(session(), cmd);
+        return true;
     }
 };
 
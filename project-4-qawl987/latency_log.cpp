@@ -0,0 +1,41 @@
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Latency samples of one command kind, in microseconds
+struct LatencyLog {
+    std::vector<double> samples;
+
+    double percentile(double p) {
+        if (samples.empty()) {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        std::size_t idx = std::min(samples.size() - 1,
+                                   (std::size_t)(p * samples.size()));
+        return samples[idx];
+    }
+
+    double mean() const {
+        double total = 0;
+        for (double v : samples) {
+            total += v;
+        }
+        return samples.empty() ? 0 : total / samples.size();
+    }
+
+    // JSON object with the count and the usual percentiles
+    std::string json() {
+        std::ostringstream ss;
+        ss << "{\"count\": " << samples.size() << ", \"mean_us\": " << mean()
+           << ", \"p50_us\": " << percentile(0.5)
+           << ", \"p99_us\": " << percentile(0.99)
+           << ", \"p999_us\": " << percentile(0.999)
+           << ", \"max_us\": " << percentile(1.0) << "}";
+        return ss.str();
+    }
+};
@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "latency_log.cpp"
+#include "prompt_client.cpp"
+
+// Load generator for the np servers (np_simple, np_single_proc,
+// np_multi_proc). Every simulated user logs in, looks up its own ID with
+// `who`, then runs a random mix of commands and times each one from the
+// write until the next prompt. The summary is printed as JSON. Logins are
+// timed too, from the connection until the first prompt, but kept out of
+// the command throughput: --commands 0 makes a reconnect storm.
+//
+// Usage: np_loadgen [--users N] [--commands N] [--timeout SEC]
+//                   [--mix k=w,...] [--path P] [--model NAME] [--seed N]
+//                   [--server-stats] [--server-pid PID] host port
+//
+// Mix kinds: external  "ls | cat | wc"
+//            numbered  "ls |1" then "cat"
+//            userpipe  "ls >ME" then "cat <ME"
+//            chat      "tell ME ..." or "yell ..."
+// np_simple serves one user and has no who/tell/yell or user pipes, run it
+// with --users 1 --mix external=1,numbered=1.
+//
+// --server-stats reads the server's `stats` builtin before and after the run
+// and adds the event loop syscalls np_single_proc made per command, to
+// compare its --io backends. It takes one more session, so keep --users
+// below the server's capacity.
+//
+// --server-pid holds every session after `who` until all users are logged
+// in, samples the memory of that server process and of its descendants
+// running the same program (np_multi_proc's user processes, not the
+// commands), then lets the commands go. So the memory is that of --users
+// sessions at once, and the latency is measured with all of them in.
+
+struct LoadOptions {
+    std::string host;
+    std::string port;
+    int users = 10;
+    int commands = 200; // per user, not counting login and setup
+    int timeout = 10;   // seconds to wait for a prompt
+    std::string path = "bin:.";
+    std::string model = "unknown";
+    unsigned seed = 1;
+    bool serverStats = false;
+    pid_t serverPid = 0;
+    std::map<std::string, int> mix = {
+        {"external", 4}, {"numbered", 2}, {"userpipe", 2}, {"chat", 2}};
+};
+
+struct ServerMemory {
+    int processes = 0;
+    int threads = 0;
+    long rssKb = 0;
+    long pssKb = 0; // shared pages split between the processes mapping them
+};
+
+struct LoadReport {
+    std::map<std::string, LatencyLog> byKind;
+    LatencyLog login; // connected until the first prompt
+    int sessionsDone = 0;
+    int errors = 0;   // connect failures and sessions closed early
+    int timeouts = 0; // commands that never got their prompt back
+    long syscallsBefore = -1; // server's "io syscalls", -1 if not read
+    long syscallsAfter = -1;
+    // --server-pid: sessions waiting for the others to log in
+    std::vector<std::function<void()>> parked;
+    bool released = false;
+    ServerMemory memory;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = Clock::now();
+};
+
+// "Key:   value kB" lines of a /proc file, summed per key asked for
+void readProcKeys(const std::string &path,
+                  std::map<std::string, long> &values) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t colon = line.find(':');
+        auto it = values.find(line.substr(0, colon));
+        if (colon != std::string::npos && it != values.end()) {
+            it->second += std::atol(line.c_str() + colon + 1);
+        }
+    }
+}
+
+ServerMemory sampleServerMemory(pid_t root) {
+    std::multimap<pid_t, pid_t> children; // ppid -> pid
+    std::map<pid_t, std::string> names;
+    DIR *dir = opendir("/proc");
+    while (dir != nullptr) {
+        dirent *entry = readdir(dir);
+        if (entry == nullptr) {
+            closedir(dir);
+            break;
+        }
+        pid_t pid = std::atoi(entry->d_name);
+        std::ifstream in("/proc/" + std::string(entry->d_name) + "/stat");
+        std::string stat;
+        if (pid <= 0 || !std::getline(in, stat)) {
+            continue;
+        }
+        // the command name may hold spaces, ppid follows ") <state> "
+        size_t open = stat.find('('), close = stat.rfind(')');
+        if (open == std::string::npos || close == std::string::npos) {
+            continue;
+        }
+        names[pid] = stat.substr(open + 1, close - open - 1);
+        std::istringstream rest(stat.substr(close + 1));
+        std::string state;
+        pid_t ppid;
+        if (rest >> state >> ppid) {
+            children.insert({ppid, pid});
+        }
+    }
+
+    ServerMemory memory;
+    std::vector<pid_t> todo = {root};
+    while (!todo.empty()) {
+        pid_t pid = todo.back();
+        todo.pop_back();
+        std::map<std::string, long> values = {
+            {"Rss", 0}, {"Pss", 0}, {"Threads", 0}};
+        readProcKeys("/proc/" + std::to_string(pid) + "/smaps_rollup", values);
+        readProcKeys("/proc/" + std::to_string(pid) + "/status", values);
+        memory.processes++;
+        memory.threads += values["Threads"];
+        memory.rssKb += values["Rss"];
+        memory.pssKb += values["Pss"];
+        auto range = children.equal_range(pid);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (names[it->second] == names[root]) {
+                todo.push_back(it->second);
+            }
+        }
+    }
+    return memory;
+}
+
+// --server-pid: once every session is parked or gone, sample the server
+// and let the parked ones go on
+void releaseParked(const LoadOptions &options, LoadReport &report) {
+    if (report.released || options.serverPid == 0 ||
+        (int)report.parked.size() + report.errors < options.users) {
+        return;
+    }
+    report.released = true;
+    report.memory = sampleServerMemory(options.serverPid);
+    std::vector<std::function<void()>> parked = std::move(report.parked);
+    for (auto &resume : parked) {
+        resume();
+    }
+}
+
+class LoadClient : public PromptClient {
+  public:
+    LoadClient(boost::asio::io_context &io_context, const LoadOptions &options,
+               LoadReport &report, unsigned seed)
+        : PromptClient(io_context), options_(options), report_(report),
+          rng_(seed), timer_(io_context) {
+        for (const auto &kv : options_.mix) {
+            if (kv.second > 0) {
+                kinds_.push_back(kv.first);
+                weights_.push_back(kv.second);
+            }
+        }
+    }
+
+  private:
+    enum class Stage { Login, Setup, Whoami, Work, Exit };
+
+    const LoadOptions &options_;
+    LoadReport &report_;
+    std::mt19937 rng_;
+    boost::asio::steady_timer timer_;
+    std::vector<std::string> kinds_;
+    std::vector<int> weights_;
+    Stage stage_ = Stage::Login;
+    std::string output_; // kept only while waiting for `who`
+    std::string myId_;
+    int remaining_ = 0;
+    std::vector<std::string> script_; // rest of the current scenario
+    std::string kind_;                // kind of the command in flight
+    Clock::time_point sentAt_;
+    bool timing_ = false;
+
+    void on_connected() override {
+        sentAt_ = Clock::now();
+        armTimeout();
+    }
+
+    void on_output(const std::string &chunk) override {
+        if (stage_ == Stage::Whoami) {
+            output_ += chunk;
+        }
+    }
+
+    // The answer to `who` is in: with --server-pid, wait for the others
+    void on_prompt() override {
+        if (stage_ != Stage::Whoami || options_.serverPid == 0 ||
+            report_.released) {
+            PromptClient::on_prompt();
+            return;
+        }
+        timer_.cancel();
+        auto self = std::static_pointer_cast<LoadClient>(shared_from_this());
+        report_.parked.push_back([self] { self->PromptClient::on_prompt(); });
+        releaseParked(options_, report_);
+    }
+
+    bool next_command(std::string &cmd) override {
+        timer_.cancel();
+        if (timing_) {
+            report_.byKind[kind_].samples.push_back(
+                std::chrono::duration<double, std::micro>(Clock::now() -
+                                                          sentAt_)
+                    .count());
+            timing_ = false;
+        }
+        switch (stage_) {
+        case Stage::Login:
+            report_.login.samples.push_back(
+                std::chrono::duration<double, std::micro>(Clock::now() -
+                                                          sentAt_)
+                    .count());
+            stage_ = Stage::Setup;
+            cmd = "setenv PATH " + options_.path;
+            armTimeout();
+            return true;
+        case Stage::Setup:
+            stage_ = Stage::Whoami;
+            cmd = "who";
+            armTimeout();
+            return true;
+        case Stage::Whoami:
+            parseWho();
+            stage_ = Stage::Work;
+            remaining_ = options_.commands;
+            [[fallthrough]];
+        case Stage::Work:
+            if (remaining_ > 0 || !script_.empty()) {
+                cmd = nextWorkCommand();
+                sentAt_ = Clock::now();
+                timing_ = true;
+                armTimeout();
+                return true;
+            }
+            stage_ = Stage::Exit;
+            cmd = "exit";
+            return true;
+        case Stage::Exit:
+            break;
+        }
+        return false;
+    }
+
+    void on_error(const boost::system::error_code &ec) override {
+        std::cerr << "connect: " << ec.message() << std::endl;
+        report_.errors++;
+        releaseParked(options_, report_);
+    }
+
+    void on_closed() override {
+        timer_.cancel();
+        if (stage_ != Stage::Exit) {
+            report_.errors++;
+        }
+        report_.sessionsDone++;
+        report_.end = Clock::now();
+        releaseParked(options_, report_);
+    }
+
+    // A server that stops answering ends the session instead of the run
+    void armTimeout() {
+        auto self = std::static_pointer_cast<LoadClient>(shared_from_this());
+        timer_.expires_after(std::chrono::seconds(options_.timeout));
+        timer_.async_wait([self](boost::system::error_code ec) {
+            if (ec) {
+                return; // prompt arrived in time
+            }
+            std::cerr << "timeout waiting for prompt" << std::endl;
+            self->report_.timeouts++;
+            self->close();
+        });
+    }
+
+    // The row marked "<-me" holds our own ID
+    void parseWho() {
+        std::istringstream ss(output_);
+        std::string line;
+        while (std::getline(ss, line)) {
+            if (line.find("<-me") != std::string::npos) {
+                myId_ = line.substr(0, line.find('\t'));
+            }
+        }
+        output_.clear();
+    }
+
+    std::string nextWorkCommand() {
+        if (script_.empty()) {
+            std::discrete_distribution<int> pick(weights_.begin(),
+                                                 weights_.end());
+            kind_ = kinds_[pick(rng_)];
+            script_ = scenario(kind_);
+            remaining_ -= script_.size();
+        }
+        std::string cmd = script_.front();
+        script_.erase(script_.begin());
+        return cmd;
+    }
+
+    std::vector<std::string> scenario(const std::string &kind) {
+        if (kind == "numbered") {
+            return {"ls |1", "cat"};
+        } else if (kind == "userpipe") {
+            return {"ls >" + myId_, "cat <" + myId_};
+        } else if (kind == "chat") {
+            if (rng_() % 2) {
+                return {"tell " + myId_ + " load test"};
+            }
+            return {"yell load test"};
+        }
+        return {"ls | cat | wc"};
+    }
+};
+
+// One extra session that runs `stats` and picks the server's io syscall
+// count out of the first line
+class StatsClient : public PromptClient {
+  public:
+    StatsClient(boost::asio::io_context &io_context, long &syscalls)
+        : PromptClient(io_context), syscalls_(syscalls) {}
+
+  private:
+    long &syscalls_;
+    bool asked_ = false;
+    std::string output_;
+
+    void on_output(const std::string &chunk) override {
+        if (asked_) {
+            output_ += chunk;
+        }
+    }
+
+    bool next_command(std::string &cmd) override {
+        if (!asked_) {
+            asked_ = true;
+            cmd = "stats";
+            return true;
+        }
+        auto pos = output_.find("io syscalls ");
+        if (pos != std::string::npos) {
+            syscalls_ = std::atol(output_.c_str() + pos + 12);
+        }
+        cmd = "exit";
+        return true;
+    }
+
+    void on_error(const boost::system::error_code &ec) override {
+        std::cerr << "stats connect: " << ec.message() << std::endl;
+    }
+};
+
+long readServerSyscalls(const LoadOptions &options) {
+    long syscalls = -1;
+    boost::asio::io_context io_context;
+    auto client = std::make_shared<StatsClient>(io_context, syscalls);
+    client->async_connect(options.host, options.port);
+    io_context.run();
+    return syscalls;
+}
+
+void printJson(LoadOptions &options, LoadReport &report) {
+    double seconds =
+        std::chrono::duration<double>(report.end - report.start).count();
+    LatencyLog all;
+    for (auto &kv : report.byKind) {
+        all.samples.insert(all.samples.end(), kv.second.samples.begin(),
+                           kv.second.samples.end());
+    }
+    std::cout << "{\n";
+    std::cout << "  \"model\": \"" << options.model << "\",\n";
+    std::cout << "  \"target\": \"" << options.host << ":" << options.port
+              << "\",\n";
+    std::cout << "  \"users\": " << options.users << ",\n";
+    std::cout << "  \"commands_per_user\": " << options.commands << ",\n";
+    std::cout << "  \"errors\": " << report.errors << ",\n";
+    std::cout << "  \"timeouts\": " << report.timeouts << ",\n";
+    std::cout << "  \"duration_s\": " << seconds << ",\n";
+    std::cout << "  \"throughput_cmd_per_s\": "
+              << (seconds > 0 ? all.samples.size() / seconds : 0) << ",\n";
+    if (report.syscallsBefore >= 0 && report.syscallsAfter >= 0) {
+        long syscalls = report.syscallsAfter - report.syscallsBefore;
+        std::cout << "  \"server_io_syscalls\": " << syscalls << ",\n";
+        std::cout << "  \"server_io_syscalls_per_cmd\": "
+                  << (all.samples.empty()
+                          ? 0
+                          : (double)syscalls / all.samples.size())
+                  << ",\n";
+    }
+    if (options.serverPid != 0) {
+        const ServerMemory &m = report.memory;
+        std::cout << "  \"server_memory\": {\"processes\": " << m.processes
+                  << ", \"threads\": " << m.threads
+                  << ", \"rss_kb\": " << m.rssKb
+                  << ", \"pss_kb\": " << m.pssKb << ", \"pss_kb_per_user\": "
+                  << (double)m.pssKb / options.users << "},\n";
+    }
+    std::cout << "  \"latency\": " << all.json() << ",\n";
+    std::cout << "  \"login_latency\": " << report.login.json() << ",\n";
+    std::cout << "  \"by_kind\": {";
+    const char *sep = "\n";
+    for (auto &kv : report.byKind) {
+        std::cout << sep << "    \"" << kv.first << "\": " << kv.second.json();
+        sep = ",\n";
+    }
+    std::cout << "\n  }\n}" << std::endl;
+}
+
+void parseMix(const std::string &arg, std::map<std::string, int> &mix) {
+    mix.clear();
+    std::stringstream ss(arg);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        auto pos = token.find('=');
+        if (pos == std::string::npos) {
+            mix[token] = 1;
+        } else {
+            mix[token.substr(0, pos)] = std::atoi(token.c_str() + pos + 1);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    LoadOptions options;
+    static const option longOptions[] = {
+        {"users", required_argument, nullptr, 'u'},
+        {"commands", required_argument, nullptr, 'c'},
+        {"timeout", required_argument, nullptr, 't'},
+        {"mix", required_argument, nullptr, 'm'},
+        {"path", required_argument, nullptr, 'p'},
+        {"model", required_argument, nullptr, 'M'},
+        {"seed", required_argument, nullptr, 's'},
+        {"server-stats", no_argument, nullptr, 'S'},
+        {"server-pid", required_argument, nullptr, 'P'},
+        {nullptr, 0, nullptr, 0},
+    };
+    std::string usage =
+        "Usage: " + std::string(argv[0]) +
+        " [--users N] [--commands N] [--timeout SEC] [--mix external=4,numbered=2,"
+        "userpipe=2,chat=2] [--path P] [--model NAME] [--seed N] [--server-stats]"
+        " [--server-pid PID] host port";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "u:c:t:m:p:M:s:SP:", longOptions,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 'u':
+            options.users = std::max(1, std::atoi(optarg));
+            break;
+        case 'c':
+            options.commands = std::max(0, std::atoi(optarg));
+            break;
+        case 't':
+            options.timeout = std::max(1, std::atoi(optarg));
+            break;
+        case 'm':
+            parseMix(optarg, options.mix);
+            break;
+        case 'p':
+            options.path = optarg;
+            break;
+        case 'M':
+            options.model = optarg;
+            break;
+        case 's':
+            options.seed = std::atoi(optarg);
+            break;
+        case 'S':
+            options.serverStats = true;
+            break;
+        case 'P':
+            options.serverPid = std::atoi(optarg);
+            break;
+        default:
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+    options.host = argv[optind];
+    options.port = argv[optind + 1];
+
+    LoadReport report;
+    try {
+        if (options.serverStats) {
+            report.syscallsBefore = readServerSyscalls(options);
+            report.start = Clock::now();
+        }
+        boost::asio::io_context io_context;
+        for (int i = 0; i < options.users; i++) {
+            auto client = std::make_shared<LoadClient>(io_context, options,
+                                                       report, options.seed + i);
+            client->async_connect(options.host, options.port);
+        }
+        io_context.run();
+        if (options.serverStats) {
+            report.syscallsAfter = readServerSyscalls(options);
+        }
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    printJson(options, report);
+    return report.errors == 0 && report.timeouts == 0 ? 0 : 2;
+}
@@ -0,0 +1,275 @@
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../project-2-qawl987/session_capture.cpp"
+#include "latency_log.cpp"
+#include "prompt_client.cpp"
+
+// Replays a session capture (np_simple / np_single_proc / np_multi_proc
+// started with --capture FILE) against any np server. Every captured session
+// becomes one concurrent client that logs in at its original offset and types
+// its lines in order, each no earlier than it was typed originally and never
+// before the previous prompt. --fast drops the pacing and sends every line
+// as soon as the prompt shows up. Command latency is reported as JSON.
+//
+// Usage: np_replay [--fast] [--speed X] [--timeout SEC] [--model NAME]
+//                  capture-file host port
+//
+// Lines that name user IDs (tell, >N, <N) assume the replayed logins get the
+// same IDs as the captured ones, which holds when sessions start in the same
+// order on an otherwise idle server.
+
+struct ReplayOptions {
+    std::string capture;
+    std::string host;
+    std::string port;
+    bool fast = false;
+    double speed = 1.0; // >1 replays faster than captured
+    int timeout = 10;   // seconds to wait for a prompt
+    std::string model = "unknown";
+};
+
+struct CapturedSession {
+    uint64_t openNs = 0;
+    std::vector<std::pair<uint64_t, std::string>> lines; // typed at, text
+};
+
+struct ReplayReport {
+    std::map<std::string, LatencyLog> byCommand;
+    int errors = 0;   // connect failures and sessions cut short
+    int timeouts = 0; // lines that never got their prompt back
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = Clock::now();
+};
+
+class ReplayClient : public PromptClient {
+  public:
+    ReplayClient(boost::asio::io_context &io_context,
+                 const CapturedSession &session, const ReplayOptions &options,
+                 ReplayReport &report, uint64_t captureOrigin)
+        : PromptClient(io_context), session_(session), options_(options),
+          report_(report), captureOrigin_(captureOrigin),
+          paceTimer_(io_context), timeoutTimer_(io_context) {}
+
+    // Connect at the session's original offset from the first login
+    void start() {
+        auto self = std::static_pointer_cast<ReplayClient>(shared_from_this());
+        paceTimer_.expires_at(due(session_.openNs));
+        paceTimer_.async_wait([self](boost::system::error_code) {
+            self->async_connect(self->options_.host, self->options_.port);
+        });
+    }
+
+  private:
+    const CapturedSession &session_;
+    const ReplayOptions &options_;
+    ReplayReport &report_;
+    uint64_t captureOrigin_;
+    boost::asio::steady_timer paceTimer_;
+    boost::asio::steady_timer timeoutTimer_;
+    std::size_t next_ = 0;
+    std::string command_; // first word of the line in flight
+    Clock::time_point sentAt_;
+    bool timing_ = false;
+
+    Clock::time_point due(uint64_t capturedNs) const {
+        if (options_.fast) {
+            return report_.start;
+        }
+        auto offset = std::chrono::nanoseconds(
+            (int64_t)((capturedNs - captureOrigin_) / options_.speed));
+        return report_.start +
+               std::chrono::duration_cast<Clock::duration>(offset);
+    }
+
+    void on_connected() override { armTimeout(); }
+
+    void on_prompt() override {
+        timeoutTimer_.cancel();
+        if (timing_) {
+            report_.byCommand[command_].samples.push_back(
+                std::chrono::duration<double, std::micro>(Clock::now() -
+                                                          sentAt_)
+                    .count());
+            timing_ = false;
+        }
+        if (next_ >= session_.lines.size()) {
+            close(); // the captured client hung up without exit
+            return;
+        }
+        auto self = std::static_pointer_cast<ReplayClient>(shared_from_this());
+        paceTimer_.expires_at(due(session_.lines[next_].first));
+        paceTimer_.async_wait([self](boost::system::error_code) {
+            self->PromptClient::on_prompt();
+        });
+    }
+
+    bool next_command(std::string &cmd) override {
+        cmd = session_.lines[next_++].second;
+        std::istringstream ss(cmd);
+        if (!(ss >> command_)) {
+            command_ = "(empty)";
+        }
+        sentAt_ = Clock::now();
+        timing_ = true;
+        armTimeout();
+        return true;
+    }
+
+    void on_error(const boost::system::error_code &ec) override {
+        std::cerr << "connect: " << ec.message() << std::endl;
+        report_.errors++;
+    }
+
+    void on_closed() override {
+        timeoutTimer_.cancel();
+        paceTimer_.cancel();
+        if (next_ < session_.lines.size()) {
+            report_.errors++;
+        }
+        report_.end = Clock::now();
+    }
+
+    void armTimeout() {
+        auto self = std::static_pointer_cast<ReplayClient>(shared_from_this());
+        timeoutTimer_.expires_after(std::chrono::seconds(options_.timeout));
+        timeoutTimer_.async_wait([self](boost::system::error_code ec) {
+            if (ec) {
+                return; // prompt arrived in time
+            }
+            std::cerr << "timeout waiting for prompt" << std::endl;
+            self->report_.timeouts++;
+            self->close();
+        });
+    }
+};
+
+// Group the records by session, in order of login
+bool loadCapture(const std::string &path, std::vector<CapturedSession> &out,
+                 uint64_t &origin) {
+    CaptureReader reader(path);
+    if (!reader.ok()) {
+        return false;
+    }
+    std::map<uint32_t, std::size_t> index;
+    CaptureRecord header;
+    std::string payload;
+    origin = 0;
+    while (reader.next(header, payload)) {
+        if (header.type == SessionCapture::OPEN) {
+            index[header.session] = out.size();
+            out.emplace_back();
+            out.back().openNs = header.monoNs;
+            if (origin == 0) {
+                origin = header.monoNs;
+            }
+        } else if (header.type == SessionCapture::LINE &&
+                   index.count(header.session)) {
+            uint64_t typedAt = header.monoNs;
+            out[index[header.session]].lines.emplace_back(typedAt, payload);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    ReplayOptions options;
+    static const option longOptions[] = {
+        {"fast", no_argument, nullptr, 'f'},
+        {"speed", required_argument, nullptr, 's'},
+        {"timeout", required_argument, nullptr, 't'},
+        {"model", required_argument, nullptr, 'M'},
+        {nullptr, 0, nullptr, 0},
+    };
+    std::string usage = "Usage: " + std::string(argv[0]) +
+                        " [--fast] [--speed X] [--timeout SEC] [--model NAME]"
+                        " capture-file host port";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "fs:t:M:", longOptions, nullptr)) !=
+           -1) {
+        switch (opt) {
+        case 'f':
+            options.fast = true;
+            break;
+        case 's':
+            options.speed = std::atof(optarg);
+            if (options.speed <= 0) {
+                options.speed = 1.0;
+            }
+            break;
+        case 't':
+            options.timeout = std::max(1, std::atoi(optarg));
+            break;
+        case 'M':
+            options.model = optarg;
+            break;
+        default:
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+    options.capture = argv[optind];
+    options.host = argv[optind + 1];
+    options.port = argv[optind + 2];
+
+    std::vector<CapturedSession> sessions;
+    uint64_t origin;
+    if (!loadCapture(options.capture, sessions, origin)) {
+        std::cerr << options.capture << ": not a session capture" << std::endl;
+        return 1;
+    }
+
+    ReplayReport report;
+    try {
+        boost::asio::io_context io_context;
+        for (const CapturedSession &session : sessions) {
+            auto client = std::make_shared<ReplayClient>(
+                io_context, session, options, report, origin);
+            client->start();
+        }
+        io_context.run();
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    double seconds =
+        std::chrono::duration<double>(report.end - report.start).count();
+    LatencyLog all;
+    for (auto &kv : report.byCommand) {
+        all.samples.insert(all.samples.end(), kv.second.samples.begin(),
+                           kv.second.samples.end());
+    }
+    std::cout << "{\n";
+    std::cout << "  \"model\": \"" << options.model << "\",\n";
+    std::cout << "  \"target\": \"" << options.host << ":" << options.port
+              << "\",\n";
+    std::cout << "  \"pace\": \""
+              << (options.fast ? "fast" : "x" + std::to_string(options.speed))
+              << "\",\n";
+    std::cout << "  \"sessions\": " << sessions.size() << ",\n";
+    std::cout << "  \"errors\": " << report.errors << ",\n";
+    std::cout << "  \"timeouts\": " << report.timeouts << ",\n";
+    std::cout << "  \"duration_s\": " << seconds << ",\n";
+    std::cout << "  \"throughput_cmd_per_s\": "
+              << (seconds > 0 ? all.samples.size() / seconds : 0) << ",\n";
+    std::cout << "  \"latency\": " << all.json() << ",\n";
+    std::cout << "  \"by_command\": {";
+    const char *sep = "\n";
+    for (auto &kv : report.byCommand) {
+        std::cout << sep << "    \"" << kv.first << "\": " << kv.second.json();
+        sep = ",\n";
+    }
+    std::cout << "\n  }\n}" << std::endl;
+    return report.errors == 0 && report.timeouts == 0 ? 0 : 2;
+}
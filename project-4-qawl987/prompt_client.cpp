@@ -0,0 +1,158 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using boost::asio::ip::tcp;
+using boost::asio::generic::stream_protocol;
+
+// One telnet style session with an np shell. Output is collected until the
+// "% " prompt shows up at the start of a line, then the next command is sent.
+// Subclasses decide what to send and what to do with the output.
+//
+// A host starting with '/' (socket file) or '@' (abstract name) is a server's
+// --unix listener on this machine, the port is ignored then.
+class PromptClient : public std::enable_shared_from_this<PromptClient> {
+  public:
+    explicit PromptClient(boost::asio::io_context &io_context)
+        : socket_(io_context), resolver_(io_context) {}
+    virtual ~PromptClient() = default;
+
+    void async_connect(const std::string &host, const std::string &port) {
+        auto self = shared_from_this();
+        if (!host.empty() && (host[0] == '/' || host[0] == '@')) {
+            std::string path = host;
+            if (path[0] == '@') {
+                path[0] = '\0';
+            }
+            socket_.async_connect(
+                boost::asio::local::stream_protocol::endpoint(path),
+                [self](boost::system::error_code ec) { self->connected(ec); });
+            return;
+        }
+        resolver_.async_resolve(
+            host, port,
+            [self](boost::system::error_code ec,
+                   const tcp::resolver::results_type &results) {
+                if (ec) {
+                    self->on_error(ec);
+                    return;
+                }
+                std::vector<stream_protocol::endpoint> endpoints;
+                for (const auto &entry : results) {
+                    endpoints.emplace_back(entry.endpoint());
+                }
+                boost::asio::async_connect(
+                    self->socket_, endpoints,
+                    [self](boost::system::error_code ec,
+                           const stream_protocol::endpoint &) {
+                        self->connected(ec);
+                    });
+            });
+    }
+
+  protected:
+    stream_protocol::socket socket_; // TCP or AF_UNIX
+
+    virtual void on_connected() {}
+    // Raw output as it arrives, prompts included
+    virtual void on_output(const std::string &) {}
+    // Asked for the command to send, return false to close the session
+    virtual bool next_command(std::string &cmd) = 0;
+    virtual void on_error(const boost::system::error_code &) {}
+    virtual void on_closed() {}
+
+    // Called once per prompt. Sends the next command right away, override
+    // to send it later with send_command.
+    virtual void on_prompt() {
+        std::string cmd;
+        if (!next_command(cmd)) {
+            close();
+            return;
+        }
+        send_command(cmd);
+    }
+
+    void send_command(const std::string &line) {
+        auto cmd = std::make_shared<std::string>(line);
+        if (cmd->empty() || cmd->back() != '\n') {
+            cmd->append(1, '\n');
+        }
+
+        auto self = shared_from_this();
+        boost::asio::async_write(socket_, boost::asio::buffer(*cmd),
+                                 [self, cmd](boost::system::error_code ec,
+                                             std::size_t) {
+                                     if (ec || *cmd == "exit\n") {
+                                         self->close();
+                                     } else {
+                                         self->async_read();
+                                     }
+                                 });
+    }
+
+    void close() {
+        if (!socket_.is_open()) {
+            return;
+        }
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        on_closed();
+    }
+
+  private:
+    tcp::resolver resolver_;
+    boost::asio::streambuf streambuf_;
+    std::string pending_; // output since the last command was sent
+
+    void connected(const boost::system::error_code &ec) {
+        if (ec) {
+            on_error(ec);
+            return;
+        }
+        on_connected();
+        async_read();
+    }
+
+    void async_read() {
+        auto self = shared_from_this();
+        boost::asio::async_read(socket_, streambuf_,
+                                boost::asio::transfer_at_least(1),
+                                [self](boost::system::error_code ec,
+                                       std::size_t) {
+                                    if (ec) {
+                                        self->close();
+                                        return;
+                                    }
+                                    self->process_response();
+                                });
+    }
+
+    // Messages from other users may arrive around the prompt, so only a
+    // "% " at the start of a line counts
+    bool prompt_seen() const {
+        for (std::size_t pos = pending_.find("% "); pos != std::string::npos;
+             pos = pending_.find("% ", pos + 1)) {
+            if (pos == 0 || pending_[pos - 1] == '\n') {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void process_response() {
+        std::string chunk(
+            boost::asio::buffers_begin(streambuf_.data()),
+            boost::asio::buffers_begin(streambuf_.data()) + streambuf_.size());
+        streambuf_.consume(streambuf_.size());
+        pending_ += chunk;
+        on_output(chunk);
+        if (!prompt_seen()) {
+            async_read();
+            return;
+        }
+        pending_.clear();
+        on_prompt();
+    }
+};